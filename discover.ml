@@ -154,6 +154,63 @@ CAMLprim value lwt_test()
 }
 "
 
+let signalfd_code = "
+#include <caml/mlvalues.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+
+CAMLprim value lwt_test()
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  return Val_unit;
+}
+"
+
+let pidfd_code = "
+#include <caml/mlvalues.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+CAMLprim value lwt_test()
+{
+  syscall(SYS_pidfd_open, getpid(), 0);
+  return Val_unit;
+}
+"
+
+let posix_spawn_code = "
+#include <caml/mlvalues.h>
+#include <spawn.h>
+#include <signal.h>
+
+CAMLprim value lwt_test()
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnp(NULL, NULL, &actions, &attr, NULL, NULL);
+  return Val_unit;
+}
+"
+
+let splice_code = "
+#define _GNU_SOURCE
+#include <caml/mlvalues.h>
+#include <fcntl.h>
+
+CAMLprim value lwt_test()
+{
+  splice(0, NULL, 1, NULL, 4096, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  return Val_unit;
+}
+"
+
 let get_credentials_code struct_name = "
 #define _GNU_SOURCE
 #include <caml/mlvalues.h>
@@ -194,6 +251,18 @@ CAMLprim value lwt_test()
 }
 "
 
+let monotonic_clock_code = "
+#include <caml/mlvalues.h>
+#include <time.h>
+
+CAMLprim value lwt_test()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return Val_unit;
+}
+"
+
 let glib_code = "
 #include <caml/mlvalues.h>
 #include <glib.h>
@@ -531,6 +600,10 @@ Lwt can use pthread or the win32 API.
 
   let do_check = !os_type <> "Win32" in
   test_feature ~do_check "eventfd" "HAVE_EVENTFD" (fun () -> test_code ([], []) eventfd_code);
+  test_feature ~do_check "signalfd" "HAVE_SIGNALFD" (fun () -> test_code ([], []) signalfd_code);
+  test_feature ~do_check "pidfd" "HAVE_PIDFD" (fun () -> test_code ([], []) pidfd_code);
+  test_feature ~do_check "posix_spawn" "HAVE_POSIX_SPAWN" (fun () -> test_code ([], []) posix_spawn_code);
+  test_feature ~do_check "splice" "HAVE_SPLICE" (fun () -> test_code ([], []) splice_code);
   test_feature ~do_check "fd passing" "HAVE_FD_PASSING" (fun () -> test_code ([], []) fd_passing_code);
   test_feature ~do_check:(do_check && not !android_target)
     "sched_getcpu" "HAVE_GETCPU" (fun () -> test_code ([], []) getcpu_code);
@@ -542,6 +615,7 @@ Lwt can use pthread or the win32 API.
   test_feature ~do_check "credentials getting (FreeBSD)" "HAVE_GET_CREDENTIALS_FREEBSD" (fun () -> test_code ([], []) (get_credentials_code "cmsgcred"));
   test_feature ~do_check "credentials getting (getpeereid)" "HAVE_GETPEEREID" (fun () -> test_code ([], []) get_peereid_code);
   test_feature ~do_check "fdatasync" "HAVE_FDATASYNC" (fun () -> test_code ([], []) fdatasync_code);
+  test_feature ~do_check "monotonic clock" "HAVE_MONOTONIC_CLOCK" (fun () -> test_code ([], []) monotonic_clock_code);
   test_feature ~do_check:(do_check && not !android_target)
     "netdb_reentrant" "HAVE_NETDB_REENTRANT" (fun () -> test_code ([], []) netdb_reentrant_code);
 
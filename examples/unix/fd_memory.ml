@@ -0,0 +1,70 @@
+(* Lightweight thread library for Objective Caml
+ * http://www.ocsigen.org/lwt
+ * Program Fd_memory
+ * Copyright (C) 2012 Jérémie Dimino
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, with linking exceptions;
+ * either version 2.1 of the License, or (at your option) any later
+ * version. See COPYING file for details.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *)
+
+(* Measure the memory used per file descriptor, both idle and with a
+   pending read, as a server holding a lot of idle connections
+   would. *)
+
+open Lwt
+
+(* Number of live words in the major heap. *)
+let live_words () =
+  Gc.full_major ();
+  (Gc.stat ()).Gc.live_words
+
+let report name count before after =
+  let words = float (after - before) /. float count in
+  Printf.printf "%-24s %8.1f words (%.0f bytes)\n%!" name words (words *. float (Sys.word_size / 8))
+
+let () =
+  let count =
+    if Array.length Sys.argv > 1 then
+      int_of_string Sys.argv.(1)
+    else
+      100000
+  in
+  Printf.printf "file descriptors: %d\n%!" count;
+
+  (* All wrappers share the same unix file descriptor, which nobody
+     ever writes to. This avoids being limited by the maximum number
+     of opened file descriptors. *)
+  let fd, _ = Unix.pipe () in
+
+  let w0 = live_words () in
+  let fds = Array.init count (fun _ -> Lwt_unix.of_unix_file_descr ~blocking:false ~set_flags:false fd) in
+  let w1 = live_words () in
+  report "idle:" count w0 w1;
+
+  let waiters = Array.map Lwt_unix.wait_read fds in
+  let w2 = live_words () in
+  report "pending read:" count w1 w2;
+
+  (* Cancel everything and let watchers be released. *)
+  Array.iter cancel waiters;
+  for i = 0 to Lwt_unix.event_hysteresis () + 1 do
+    Lwt_main.run (Lwt_unix.yield ())
+  done;
+  let w3 = live_words () in
+  report "after cancel:" count w0 w3;
+
+  print_endline "(memory allocated outside the OCaml heap by the engine is not counted)";
+  ignore (Array.length fds, Array.length waiters)
@@ -1172,6 +1172,12 @@ let with_value key value f =
 
 let pause_hook = ref ignore
 
+(* A slice is what runs between two calls to [wakeup_paused], which
+   the scheduler does at each iteration. [steps] counts the calls to
+   [auto_pause] during the current slice. *)
+let budget = ref 0
+let steps = ref 0
+
 let paused = Lwt_sequence.create ()
 let paused_count = ref 0
 
@@ -1182,6 +1188,7 @@ let pause () =
   waiter
 
 let wakeup_paused () =
+  steps := 0;
   if not (Lwt_sequence.is_empty paused) then begin
     let tmp = Lwt_sequence.create () in
     Lwt_sequence.transfer_r paused tmp;
@@ -1191,6 +1198,24 @@ let wakeup_paused () =
 
 let register_pause_notifier f = pause_hook := f
 
+let auto_pause () =
+  if !budget = 0 then
+    return_unit
+  else begin
+    incr steps;
+    if !steps >= !budget then begin
+      steps := 0;
+      pause ()
+    end else
+      return_unit
+  end
+
+let slice_budget () = !budget
+
+let set_slice_budget n =
+  if n < 0 then invalid_arg "Lwt.set_slice_budget";
+  budget := n
+
 let paused_count () = !paused_count
 
 (* +-----------------------------------------------------------------+
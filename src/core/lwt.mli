@@ -407,6 +407,27 @@ val register_pause_notifier : (int -> unit) -> unit
       the new number of threads paused. It is usefull to be able to
       call {!wakeup_paused} when there is no scheduler *)
 
+val auto_pause : unit -> unit t
+  (** [auto_pause ()] is a cheap yield point for long running loops:
+      it returns [pause ()] once the current slice has used up its
+      budget, and a terminated thread otherwise. A slice is what runs
+      between two calls to {!wakeup_paused}, i.e. one iteration of
+      the scheduler, and its budget is a number of calls to
+      [auto_pause].
+
+      It is used by the sequential iterators of {!Lwt_list} and
+      {!Lwt_stream}, and by [for_lwt] loops. *)
+
+val slice_budget : unit -> int
+  (** Returns the number of calls to {!auto_pause} allowed per
+      slice. *)
+
+val set_slice_budget : int -> unit
+  (** Sets the number of calls to {!auto_pause} allowed per slice. [0],
+      the default, disables automatic pauses. Only enable them if a
+      scheduler calls {!wakeup_paused} regularly, such as
+      [Lwt_main.run]. *)
+
 (** {6 Misc} *)
 
 val on_success : 'a t -> ('a -> unit) -> unit
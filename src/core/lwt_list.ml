@@ -29,6 +29,7 @@ let rec iter_s f l =
         Lwt.return_unit
     | x :: l ->
         f x >>= fun () ->
+        Lwt.auto_pause () >>= fun () ->
         iter_s f l
 
 let rec iter_p f l =
@@ -45,6 +46,7 @@ let rec map_s f l =
         Lwt.return_nil
     | x :: l ->
         f x >>= fun x ->
+        Lwt.auto_pause () >>= fun () ->
         map_s f l >|= fun l ->
         x :: l
 
@@ -64,6 +66,7 @@ let rec rev_map_append_s acc f l =
         Lwt.return acc
     | x :: l ->
         f x >>= fun x ->
+        Lwt.auto_pause () >>= fun () ->
         rev_map_append_s (x :: acc) f l
 
 let rev_map_s f l =
@@ -88,6 +91,7 @@ let rec fold_left_s f acc l =
         Lwt.return acc
     | x :: l ->
         f acc x >>= fun acc ->
+        Lwt.auto_pause () >>= fun () ->
         fold_left_s f acc l
 
 let rec fold_right_s f l acc =
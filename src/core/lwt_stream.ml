@@ -892,6 +892,7 @@ let rec iter_s_rec node f s =
       | Some x ->
           consume s node;
           f x >>= fun () ->
+          Lwt.auto_pause () >>= fun () ->
           iter_s_rec node.next f s
       | None ->
           Lwt.return_unit
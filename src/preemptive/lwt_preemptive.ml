@@ -56,63 +56,56 @@ let threads_count = ref 0
    | Preemptive threads management                                   |
    +-----------------------------------------------------------------+ *)
 
-type thread = {
-  task_channel: (int * (unit -> unit)) Event.channel;
-  (* Channel used to communicate notification id and tasks to the
-     worker thread. *)
+(* Workers are persistent and all take their tasks from the same
+   queue, so a task is handed to a worker with a single mutex
+   operation, without rendez-vous with a particular thread. *)
 
-  mutable thread : Thread.t;
-  (* The worker thread. *)
+(* Tasks waiting for a worker: *)
+let tasks : (unit -> unit) Queue.t = Queue.create ()
 
-  mutable reuse : bool;
-  (* Whether the thread must be readded to the pool when the work is
-     done. *)
-}
+(* Mutex protecting [tasks], [idle_workers] and [threads_count]: *)
+let tasks_mutex = Mutex.create ()
 
-(* Pool of worker threads: *)
-let workers : thread Queue.t = Queue.create ()
+(* Condition signaled when a task is added: *)
+let task_added = Condition.create ()
 
-(* Queue of clients waiting for a worker to be available: *)
-let waiters : thread Lwt.u Lwt_sequence.t = Lwt_sequence.create ()
+(* Number of workers waiting for a task: *)
+let idle_workers = ref 0
 
 (* Code executed by a worker: *)
-let rec worker_loop worker =
-  let id, task = Event.sync (Event.receive worker.task_channel) in
-  task ();
+let rec worker_loop () =
+  Mutex.lock tasks_mutex;
+  while Queue.is_empty tasks && !threads_count <= !max_threads do
+    incr idle_workers;
+    Condition.wait task_added tasks_mutex;
+    decr idle_workers
+  done;
   (* If there is too much threads, exit. This can happen if the user
      decreased the maximum: *)
-  if !threads_count > !max_threads then worker.reuse <- false;
-  (* Tell the main thread that work is done: *)
-  Lwt_unix.send_notification id;
-  if worker.reuse then worker_loop worker
+  if !threads_count > !max_threads then begin
+    decr threads_count;
+    Mutex.unlock tasks_mutex
+  end else begin
+    let task = Queue.take tasks in
+    Mutex.unlock tasks_mutex;
+    task ();
+    worker_loop ()
+  end
 
-(* create a new worker: *)
+(* Create a new worker, [tasks_mutex] must be locked: *)
 let make_worker () =
   incr threads_count;
-  let worker = {
-    task_channel = Event.new_channel ();
-    thread = Thread.self ();
-    reuse = true;
-  } in
-  worker.thread <- Thread.create worker_loop worker;
-  worker
-
-(* Add a worker to the pool: *)
-let add_worker worker =
-  match Lwt_sequence.take_opt_l waiters with
-    | None ->
-        Queue.add worker workers
-    | Some w ->
-        wakeup w worker
-
-(* Wait for worker to be available, then return it: *)
-let rec get_worker () =
-  if not (Queue.is_empty workers) then
-    return (Queue.take workers)
-  else if !threads_count < !max_threads then
-    return (make_worker ())
-  else
-    Lwt.add_task_r waiters
+  ignore (Thread.create worker_loop ())
+
+(* Queue a task, and wake up or create a worker for it: *)
+let add_task task =
+  Mutex.lock tasks_mutex;
+  Queue.add task tasks;
+  if !idle_workers > 0 then Condition.signal task_added;
+  (* Idle workers may have already been signaled by previous tasks
+     and not be awake yet. *)
+  if Queue.length tasks > !idle_workers && !threads_count < !max_threads then make_worker ();
+  Mutex.unlock tasks_mutex
 
 (* +-----------------------------------------------------------------+
    | Initialisation, and dynamic parameters reset                    |
@@ -122,13 +115,17 @@ let get_bounds () = (!min_threads, !max_threads)
 
 let set_bounds (min, max) =
   if min < 0 || max < min then invalid_arg "Lwt_preemptive.set_bounds";
+  Mutex.lock tasks_mutex;
   let diff = min - !threads_count in
   min_threads := min;
   max_threads := max;
   (* Launch new workers: *)
   for i = 1 to diff do
-    add_worker (make_worker ())
-  done
+    make_worker ()
+  done;
+  (* Wake up idle workers so the extra ones exit: *)
+  if !threads_count > max then Condition.broadcast task_added;
+  Mutex.unlock tasks_mutex
 
 let initialized = ref false
 
@@ -144,46 +141,53 @@ let simple_init () =
   end
 
 let nbthreads () = !threads_count
-let nbthreadsqueued () = Lwt_sequence.fold_l (fun _ x -> x + 1) waiters 0
-let nbthreadsbusy () = !threads_count - Queue.length workers
+let nbthreadsqueued () = Queue.length tasks
+let nbthreadsbusy () = !threads_count - !idle_workers
 
 (* +-----------------------------------------------------------------+
    | Detaching                                                       |
    +-----------------------------------------------------------------+ *)
 
-let init_result = Lwt.make_error (Failure "Lwt_preemptive.detach")
+(* Actions to execute in the main thread, sent by other threads and
+   protected by [main_actions_mutex]. This is used both for completed
+   tasks and for {!run_in_main}: *)
+let main_actions : (unit -> unit) Queue.t = Queue.create ()
+let main_actions_mutex = Mutex.create ()
+
+(* The notification is shared by all actions. It is only sent when
+   the queue becomes non-empty, and the main thread then executes all
+   the actions queued so far at once. *)
+let main_notification =
+  Lwt_unix.make_notification
+    (fun () ->
+       let actions = Queue.create () in
+       Mutex.lock main_actions_mutex;
+       Queue.transfer main_actions actions;
+       Mutex.unlock main_actions_mutex;
+       Queue.iter (fun f -> f ()) actions)
+
+let add_main_action action =
+  Mutex.lock main_actions_mutex;
+  let was_empty = Queue.is_empty main_actions in
+  Queue.add action main_actions;
+  Mutex.unlock main_actions_mutex;
+  if was_empty then Lwt_unix.send_notification main_notification
 
 let detach f args =
   simple_init ();
-  let result = ref init_result in
+  let waiter, wakener = wait () in
   (* The task for the worker thread: *)
   let task () =
-    try
-      result := Lwt.make_value (f args)
-    with exn ->
-      result := Lwt.make_error exn
-  in
-  lwt worker = get_worker () in
-  let waiter, wakener = wait () in
-  let id =
-    Lwt_unix.make_notification ~once:true
-      (fun () -> Lwt.wakeup_result wakener !result)
+    let result =
+      try
+        Lwt.make_value (f args)
+      with exn ->
+        Lwt.make_error exn
+    in
+    add_main_action (fun () -> Lwt.wakeup_result wakener result)
   in
-  try_lwt
-    (* Send the id and the task to the worker: *)
-    Event.sync (Event.send worker.task_channel (id, task));
-    waiter
-  finally
-    if worker.reuse then
-      (* Put back the worker to the pool: *)
-      add_worker worker
-    else begin
-      decr threads_count;
-      (* Or wait for the thread to terminates, to free its associated
-         resources: *)
-      Thread.join worker.thread
-    end;
-    return ()
+  add_task task;
+  waiter
 
 (* +-----------------------------------------------------------------+
    | Running Lwt threads in the main thread                          |
@@ -193,43 +197,36 @@ type 'a result =
   | Value of 'a
   | Error of exn
 
-(* Queue of [unit -> unit Lwt.t] functions. *)
-let jobs = Queue.create ()
-
-(* Mutex to protect access to [jobs]. *)
-let jobs_mutex = Mutex.create ()
-
-let job_notification =
-  Lwt_unix.make_notification
-    (fun () ->
-       (* Take the first job. The queue is never empty at this
-          point. *)
-       Mutex.lock jobs_mutex;
-       let thunk = Queue.take jobs in
-       Mutex.unlock jobs_mutex;
-       ignore (thunk ()))
+(* Results of [run_in_main] are passed back under [results_mutex].
+   Each call has its own condition, so only the thread waiting for a
+   result is woken up. *)
+let results_mutex = Mutex.create ()
 
 let run_in_main f =
-  let channel = Event.new_channel () in
+  let result = ref None and result_available = Condition.create () in
+  let set_result x =
+    Mutex.lock results_mutex;
+    result := Some x;
+    Condition.signal result_available;
+    Mutex.unlock results_mutex
+  in
   (* Create the job. *)
   let job () =
-    (* Execute [f] and wait for its result. *)
-    lwt result =
-      try_bind f
-        (fun ret -> return (Value ret))
-        (fun exn -> return (Error exn))
-    in
-    (* Send the result. *)
-    Event.sync (Event.send channel result);
-    return ()
+    Lwt.on_any (Lwt.apply f ())
+      (fun ret -> set_result (Value ret))
+      (fun exn -> set_result (Error exn))
   in
-  (* Add the job to the queue. *)
-  Mutex.lock jobs_mutex;
-  Queue.add job jobs;
-  Mutex.unlock jobs_mutex;
-  (* Notify the main thread. *)
-  Lwt_unix.send_notification job_notification;
+  add_main_action job;
   (* Wait for the result. *)
-  match Event.sync (Event.receive channel) with
-    | Value ret -> ret
-    | Error exn -> raise exn
+  Mutex.lock results_mutex;
+  while !result = None do
+    Condition.wait result_available results_mutex
+  done;
+  Mutex.unlock results_mutex;
+  match !result with
+    | Some (Value ret) -> ret
+    | Some (Error exn) -> raise exn
+    | None -> assert false
+
+let run_in_main_async f =
+  add_main_action (fun () -> Lwt.async f)
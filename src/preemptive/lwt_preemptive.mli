@@ -32,6 +32,16 @@ val run_in_main : (unit -> 'a Lwt.t) -> 'a
   (** [run_in_main f] executes [f] in the main thread, i.e. the one
       executing {!Lwt_main.run} and returns its result. *)
 
+val run_in_main_async : (unit -> unit Lwt.t) -> unit
+  (** [run_in_main_async f] queues [f] for execution in the main
+      thread and returns immediately. Exceptions raised by [f] are
+      passed to {!Lwt.async_exception_hook}.
+
+      Functions queued by several threads are executed in batches,
+      with one wakeup of the main thread per batch, so this is much
+      cheaper than {!run_in_main} for frequent notifications such as
+      progress reports. *)
+
 val init : int -> int -> (string -> unit) -> unit
   (** [init min max log] initialises this module. i.e. it launches the
       minimum number of preemptive threads and starts the {b
@@ -265,6 +265,103 @@ let sendto fd buf pos len flags addr =
 
 #endif
 
+(* +-----------------------------------------------------------------+
+   | Parallel kernels                                                |
+   +-----------------------------------------------------------------+ *)
+
+(* Minimum size of the parts of a range processed in parallel: *)
+let parallel_chunk_size = 1 lsl 20
+
+(* Split a range into parts processed by different jobs: *)
+let split ofs len =
+  let parts = max 1 (min (Lwt_unix.pool_size ()) (len / parallel_chunk_size)) in
+  let size = len / parts in
+  let rec loop i acc =
+    if i < 0 then
+      acc
+    else
+      let start = ofs + i * size in
+      let stop = if i = parts - 1 then ofs + len else start + size in
+      loop (i - 1) ((start, stop - start) :: acc)
+  in
+  loop (parts - 1) []
+
+let check_range name buf ofs len =
+  if ofs < 0 || len < 0 || ofs > length buf - len then invalid_arg name
+
+external crc32c_job : t -> int -> int -> int32 -> int32 job = "lwt_unix_crc32c_job"
+external crc32c_combine : int32 -> int32 -> int -> int32 = "lwt_unix_crc32c_combine"
+
+let crc32c ?(crc = 0l) buf ofs len =
+  check_range "Lwt_bytes.crc32c" buf ofs len;
+  match split ofs len with
+    | [] ->
+        assert false
+    | (ofs0, len0) :: parts ->
+        (* The first part continues [crc], the other ones are computed
+           independently and appended to it. *)
+        lwt crc0 = run_job (crc32c_job buf ofs0 len0 crc)
+        and crcs = Lwt_list.map_p (fun (ofs, len) -> run_job (crc32c_job buf ofs len 0l) >|= fun crc -> (crc, len)) parts in
+        return (List.fold_left (fun acc (crc, len) -> crc32c_combine acc crc len) crc0 crcs)
+
+external xxh64_job : t -> int -> int -> int64 -> int64 job = "lwt_unix_xxh64_job"
+
+let xxh64 ?(seed = 0L) buf ofs len =
+  check_range "Lwt_bytes.xxh64" buf ofs len;
+  run_job (xxh64_job buf ofs len seed)
+
+external find_job : t -> int -> int -> string -> int job = "lwt_unix_find_job"
+
+let find buf ofs len pattern =
+  check_range "Lwt_bytes.find" buf ofs len;
+  let plen = String.length pattern in
+  if plen > len then
+    return None
+  else begin
+    (* Parts overlap so that occurrences spanning two of them are
+       found. *)
+    let parts = split ofs (len - plen + 1) in
+    lwt results = Lwt_list.map_p (fun (ofs, len) -> run_job (find_job buf ofs (len + plen - 1) pattern) >|= fun n -> (ofs, n)) parts in
+    return
+      (List.fold_left
+         (fun acc (part_ofs, n) ->
+            match acc with
+              | Some _ -> acc
+              | None -> if n < 0 then None else Some (part_ofs + n))
+         None results)
+  end
+
+external frequencies_job : t -> int -> int -> int array job = "lwt_unix_frequencies_job"
+
+let frequencies buf ofs len =
+  check_range "Lwt_bytes.frequencies" buf ofs len;
+  lwt counts = Lwt_list.map_p (fun (ofs, len) -> run_job (frequencies_job buf ofs len)) (split ofs len) in
+  match counts with
+    | [] ->
+        assert false
+    | first :: others ->
+        List.iter (fun a -> Array.iteri (fun i n -> first.(i) <- first.(i) + n) a) others;
+        return first
+
+external overlap : t -> int -> t -> int -> int -> bool = "lwt_unix_bytes_overlap" "noalloc"
+external blit_job : t -> int -> t -> int -> int -> unit job = "lwt_unix_blit_job"
+
+let parallel_blit src_buf src_ofs dst_buf dst_ofs len =
+  check_range "Lwt_bytes.parallel_blit" src_buf src_ofs len;
+  check_range "Lwt_bytes.parallel_blit" dst_buf dst_ofs len;
+  if overlap src_buf src_ofs dst_buf dst_ofs len then
+    run_job (blit_job src_buf src_ofs dst_buf dst_ofs len)
+  else
+    Lwt_list.iter_p
+      (fun (ofs, len) -> run_job (blit_job src_buf ofs dst_buf (dst_ofs + ofs - src_ofs) len))
+      (split src_ofs len)
+
+external fill_job : t -> int -> int -> char -> unit job = "lwt_unix_fill_job"
+
+let parallel_fill buf ofs len ch =
+  check_range "Lwt_bytes.parallel_fill" buf ofs len;
+  Lwt_list.iter_p (fun (ofs, len) -> run_job (fill_job buf ofs len ch)) (split ofs len)
+
 (* +-----------------------------------------------------------------+
    | Memory mapped files                                             |
    +-----------------------------------------------------------------+ *)
@@ -131,6 +131,42 @@ val recv_msg : socket : Lwt_unix.file_descr -> io_vectors : io_vector list -> (i
 val send_msg : socket : Lwt_unix.file_descr -> io_vectors : io_vector list -> fds : Unix.file_descr list -> int Lwt.t
   (** This call is not available on windows. *)
 
+(** {6 Parallel kernels} *)
+
+(** The following functions run in the pool of system threads used
+    for jobs, without the OCaml runtime lock. Ranges of more than one
+    megabyte are split into several parts processed in parallel, up
+    to {!Lwt_unix.pool_size} at the same time. The byte array must not
+    be modified until the returned thread terminates. *)
+
+val crc32c : ?crc : int32 -> t -> int -> int -> int32 Lwt.t
+  (** [crc32c ?crc buf ofs len] returns the CRC32C (Castagnoli) of the
+      [len] bytes of [buf] at [ofs]. If [crc] is given, the
+      computation continues the one which returned [crc], so the
+      checksum of a stream can be computed piece by piece. *)
+
+val xxh64 : ?seed : int64 -> t -> int -> int -> int64 Lwt.t
+  (** [xxh64 ?seed buf ofs len] returns the 64 bits xxHash of the
+      [len] bytes of [buf] at [ofs]. The algorithm is sequential, so
+      it is always done by a single job. *)
+
+val find : t -> int -> int -> string -> int option Lwt.t
+  (** [find buf ofs len pattern] returns the offset in [buf] of the
+      first occurrence of [pattern] in the [len] bytes of [buf] at
+      [ofs], if any. *)
+
+val frequencies : t -> int -> int -> int array Lwt.t
+  (** [frequencies buf ofs len] returns an array of [256] elements,
+      containing the number of occurrences of each byte value in the
+      [len] bytes of [buf] at [ofs]. *)
+
+val parallel_blit : t -> int -> t -> int -> int -> unit Lwt.t
+  (** Same as {!blit} but done by jobs. Overlapping ranges are copied
+      by a single job. *)
+
+val parallel_fill : t -> int -> int -> char -> unit Lwt.t
+  (** Same as {!fill} but done by jobs. *)
+
 (** {6 Memory mapped files} *)
 
 val map_file : fd : Unix.file_descr -> ?pos : int64 -> shared : bool -> ?size : int -> unit -> t
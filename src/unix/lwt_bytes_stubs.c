@@ -0,0 +1,631 @@
+/* Lightweight thread library for Objective Caml
+ * http://www.ocsigen.org/lwt
+ * Module Lwt_bytes_stubs
+ * Copyright (C) 2012 Jérémie Dimino
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, with linking exceptions;
+ * either version 2.1 of the License, or (at your option) any later
+ * version. See COPYING file for details.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ */
+
+/* Kernels operating on byte arrays. They are executed as jobs, so
+   they run without the runtime lock, possibly several at the same
+   time on different parts of a buffer. */
+
+#include <lwt_config.h>
+
+#if defined(LWT_ON_WINDOWS)
+#  include <winsock2.h>
+#  include <windows.h>
+#endif
+
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/bigarray.h>
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#  define HAVE_CRC32C_SSE42
+#  include <nmmintrin.h>
+#endif
+
+#include "lwt_unix.h"
+
+#define Bytes_val(buf, ofs) ((unsigned char*)Caml_ba_data_val(buf) + Long_val(ofs))
+
+/* +-----------------------------------------------------------------+
+   | CRC32C                                                          |
+   +-----------------------------------------------------------------+ */
+
+/* Castagnoli polynomial, reversed. */
+#define CRC32C_POLY 0x82f63b78
+
+/* Tables for the slicing-by-8 algorithm. */
+static uint32_t crc32c_table[8][256];
+static int crc32c_initialized = 0;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t length);
+
+/* The implementation to use, chosen at initialization according to
+   the features of the cpu. */
+static uint32_t (*crc32c)(uint32_t crc, const unsigned char *data, size_t length) = crc32c_sw;
+
+#if defined(HAVE_CRC32C_SSE42)
+
+/* Version using the crc32 instruction of SSE 4.2, which processes 8
+   bytes at a time. */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+  uint64_t crc64;
+  crc = ~crc;
+  while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+    length--;
+  }
+  crc64 = crc;
+  while (length >= 8) {
+    crc64 = _mm_crc32_u64(crc64, *(const uint64_t*)data);
+    data += 8;
+    length -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (length > 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+    length--;
+  }
+  return ~crc;
+}
+
+#endif
+
+static void crc32c_init()
+{
+  uint32_t crc;
+  int i, j;
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+#if defined(HAVE_CRC32C_SSE42)
+  if (__builtin_cpu_supports("sse4.2")) crc32c = crc32c_sse42;
+#endif
+  crc32c_initialized = 1;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *data, size_t length)
+{
+  crc = ~crc;
+  while (length > 0 && ((uintptr_t)data & 7) != 0) {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    length--;
+  }
+  while (length >= 8) {
+    uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+    uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+      crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+      crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    data += 8;
+    length -= 8;
+  }
+  while (length > 0) {
+    crc = crc32c_table[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    length--;
+  }
+  return ~crc;
+}
+
+/* Combining CRCs of consecutive blocks, as done by zlib's
+   crc32_combine. */
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+  int n;
+  for (n = 0; n < 32; n++)
+    square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, long length2)
+{
+  uint32_t even[32], odd[32], row;
+  int n;
+
+  if (length2 <= 0) return crc1;
+
+  /* Operator for one zero bit. */
+  odd[0] = CRC32C_POLY;
+  row = 1;
+  for (n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  /* Operators for two and four zero bits. */
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+
+  /* Apply [length2] zero bytes to [crc1]. */
+  do {
+    gf2_matrix_square(even, odd);
+    if (length2 & 1) crc1 = gf2_matrix_times(even, crc1);
+    length2 >>= 1;
+    if (length2 == 0) break;
+    gf2_matrix_square(odd, even);
+    if (length2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+    length2 >>= 1;
+  } while (length2 != 0);
+
+  return crc1 ^ crc2;
+}
+
+CAMLprim value lwt_unix_crc32c_combine(value val_crc1, value val_crc2, value val_length2)
+{
+  return caml_copy_int32(crc32c_combine(Int32_val(val_crc1), Int32_val(val_crc2), Long_val(val_length2)));
+}
+
+struct job_crc32c {
+  struct lwt_unix_job job;
+  unsigned char *buffer;
+  long length;
+  uint32_t crc;
+};
+
+static void worker_crc32c(struct job_crc32c *job)
+{
+  job->crc = crc32c(job->crc, job->buffer, job->length);
+}
+
+static value result_crc32c(struct job_crc32c *job)
+{
+  uint32_t crc = job->crc;
+  lwt_unix_free_job(&job->job);
+  return caml_copy_int32(crc);
+}
+
+CAMLprim value lwt_unix_crc32c_job(value val_buf, value val_ofs, value val_len, value val_crc)
+{
+  LWT_UNIX_INIT_JOB(job, crc32c, 0);
+  if (!crc32c_initialized) crc32c_init();
+  job->buffer = Bytes_val(val_buf, val_ofs);
+  job->length = Long_val(val_len);
+  job->crc = Int32_val(val_crc);
+  return lwt_unix_alloc_job(&(job->job));
+}
+
+/* +-----------------------------------------------------------------+
+   | xxHash                                                          |
+   +-----------------------------------------------------------------+ */
+
+/* XXH64, from the reference implementation by Yann Collet. */
+
+#define PRIME64_1 11400714785074694791ULL
+#define PRIME64_2 14029467366897019727ULL
+#define PRIME64_3 1609587929392839161ULL
+#define PRIME64_4 9650029242287828579ULL
+#define PRIME64_5 2870177450012600261ULL
+
+#define rotl64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static uint64_t read64(const unsigned char *p)
+{
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+    (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+  acc ^= xxh64_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* State of an xxh64 computation. */
+struct xxh64_state {
+  uint64_t total_length;
+  uint64_t v1, v2, v3, v4;
+  /* Bytes of the current stripe of 32 bytes. */
+  unsigned char buffer[32];
+  size_t buffer_size;
+};
+
+static void xxh64_init(struct xxh64_state *state, uint64_t seed)
+{
+  state->total_length = 0;
+  state->v1 = seed + PRIME64_1 + PRIME64_2;
+  state->v2 = seed + PRIME64_2;
+  state->v3 = seed;
+  state->v4 = seed - PRIME64_1;
+  state->buffer_size = 0;
+}
+
+static void xxh64_update(struct xxh64_state *state, const unsigned char *data, size_t length)
+{
+  const unsigned char *end = data + length;
+
+  state->total_length += length;
+
+  /* Complete the pending stripe first. */
+  if (state->buffer_size + length < 32) {
+    memcpy(state->buffer + state->buffer_size, data, length);
+    state->buffer_size += length;
+    return;
+  }
+  if (state->buffer_size > 0) {
+    size_t fill = 32 - state->buffer_size;
+    memcpy(state->buffer + state->buffer_size, data, fill);
+    state->v1 = xxh64_round(state->v1, read64(state->buffer));
+    state->v2 = xxh64_round(state->v2, read64(state->buffer + 8));
+    state->v3 = xxh64_round(state->v3, read64(state->buffer + 16));
+    state->v4 = xxh64_round(state->v4, read64(state->buffer + 24));
+    data += fill;
+    state->buffer_size = 0;
+  }
+
+  if (data + 32 <= end) {
+    uint64_t v1 = state->v1, v2 = state->v2, v3 = state->v3, v4 = state->v4;
+    do {
+      v1 = xxh64_round(v1, read64(data));
+      v2 = xxh64_round(v2, read64(data + 8));
+      v3 = xxh64_round(v3, read64(data + 16));
+      v4 = xxh64_round(v4, read64(data + 24));
+      data += 32;
+    } while (data + 32 <= end);
+    state->v1 = v1;
+    state->v2 = v2;
+    state->v3 = v3;
+    state->v4 = v4;
+  }
+
+  if (data < end) {
+    memcpy(state->buffer, data, end - data);
+    state->buffer_size = end - data;
+  }
+}
+
+static uint64_t xxh64_digest(const struct xxh64_state *state)
+{
+  const unsigned char *p = state->buffer;
+  const unsigned char *end = p + state->buffer_size;
+  uint64_t h;
+
+  if (state->total_length >= 32) {
+    h = rotl64(state->v1, 1) + rotl64(state->v2, 7) + rotl64(state->v3, 12) + rotl64(state->v4, 18);
+    h = xxh64_merge_round(h, state->v1);
+    h = xxh64_merge_round(h, state->v2);
+    h = xxh64_merge_round(h, state->v3);
+    h = xxh64_merge_round(h, state->v4);
+  } else
+    h = state->v3 + PRIME64_5;
+
+  h += state->total_length;
+
+  while (p + 8 <= end) {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    p += 8;
+  }
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= *p * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+    p++;
+  }
+
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+struct job_xxh64 {
+  struct lwt_unix_job job;
+  unsigned char *buffer;
+  long length;
+  uint64_t seed;
+  uint64_t hash;
+};
+
+static void worker_xxh64(struct job_xxh64 *job)
+{
+  struct xxh64_state state;
+  xxh64_init(&state, job->seed);
+  xxh64_update(&state, job->buffer, job->length);
+  job->hash = xxh64_digest(&state);
+}
+
+static value result_xxh64(struct job_xxh64 *job)
+{
+  uint64_t hash = job->hash;
+  lwt_unix_free_job(&job->job);
+  return caml_copy_int64(hash);
+}
+
+CAMLprim value lwt_unix_xxh64_job(value val_buf, value val_ofs, value val_len, value val_seed)
+{
+  LWT_UNIX_INIT_JOB(job, xxh64, 0);
+  job->buffer = Bytes_val(val_buf, val_ofs);
+  job->length = Long_val(val_len);
+  job->seed = Int64_val(val_seed);
+  return lwt_unix_alloc_job(&(job->job));
+}
+
+/* +-----------------------------------------------------------------+
+   | Searching                                                       |
+   +-----------------------------------------------------------------+ */
+
+struct job_find {
+  struct lwt_unix_job job;
+  unsigned char *buffer;
+  long length;
+  long result;
+  long pattern_length;
+  unsigned char pattern[];
+};
+
+/* Same as memmem, which is not available everywhere. */
+static void worker_find(struct job_find *job)
+{
+  unsigned char *start = job->buffer;
+  unsigned char *last = job->buffer + job->length - job->pattern_length;
+  unsigned char *p = start;
+
+  job->result = -1;
+  if (job->pattern_length == 0) {
+    job->result = 0;
+    return;
+  }
+  while (p <= last) {
+    p = memchr(p, job->pattern[0], last - p + 1);
+    if (p == NULL) return;
+    if (memcmp(p + 1, job->pattern + 1, job->pattern_length - 1) == 0) {
+      job->result = p - start;
+      return;
+    }
+    p++;
+  }
+}
+
+static value result_find(struct job_find *job)
+{
+  long result = job->result;
+  lwt_unix_free_job(&job->job);
+  return Val_long(result);
+}
+
+CAMLprim value lwt_unix_find_job(value val_buf, value val_ofs, value val_len, value val_pattern)
+{
+  long pattern_length = caml_string_length(val_pattern);
+  LWT_UNIX_INIT_JOB(job, find, pattern_length);
+  job->buffer = Bytes_val(val_buf, val_ofs);
+  job->length = Long_val(val_len);
+  job->pattern_length = pattern_length;
+  memcpy(job->pattern, String_val(val_pattern), pattern_length);
+  return lwt_unix_alloc_job(&(job->job));
+}
+
+/* +-----------------------------------------------------------------+
+   | Byte frequencies                                                |
+   +-----------------------------------------------------------------+ */
+
+struct job_frequencies {
+  struct lwt_unix_job job;
+  unsigned char *buffer;
+  long length;
+  long counts[256];
+};
+
+static void worker_frequencies(struct job_frequencies *job)
+{
+  /* Several tables avoid stalls on repeated bytes. */
+  long counts[4][256];
+  unsigned char *p = job->buffer;
+  long i, n = job->length;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i + 4 <= n; i += 4) {
+    counts[0][p[i]]++;
+    counts[1][p[i + 1]]++;
+    counts[2][p[i + 2]]++;
+    counts[3][p[i + 3]]++;
+  }
+  for (; i < n; i++)
+    counts[0][p[i]]++;
+  for (i = 0; i < 256; i++)
+    job->counts[i] = counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+}
+
+static value result_frequencies(struct job_frequencies *job)
+{
+  value result = caml_alloc_tuple(256);
+  int i;
+  for (i = 0; i < 256; i++)
+    Field(result, i) = Val_long(job->counts[i]);
+  lwt_unix_free_job(&job->job);
+  return result;
+}
+
+CAMLprim value lwt_unix_frequencies_job(value val_buf, value val_ofs, value val_len)
+{
+  LWT_UNIX_INIT_JOB(job, frequencies, 0);
+  job->buffer = Bytes_val(val_buf, val_ofs);
+  job->length = Long_val(val_len);
+  return lwt_unix_alloc_job(&(job->job));
+}
+
+/* +-----------------------------------------------------------------+
+   | Copying and filling                                             |
+   +-----------------------------------------------------------------+ */
+
+/* Whether two ranges share memory, in which case copying them in
+   several parts at the same time is not possible. */
+CAMLprim value lwt_unix_bytes_overlap(value val_buf1, value val_ofs1, value val_buf2, value val_ofs2, value val_len)
+{
+  unsigned char *p1 = Bytes_val(val_buf1, val_ofs1);
+  unsigned char *p2 = Bytes_val(val_buf2, val_ofs2);
+  long len = Long_val(val_len);
+  return Val_bool(p1 < p2 + len && p2 < p1 + len);
+}
+
+struct job_blit {
+  struct lwt_unix_job job;
+  unsigned char *src;
+  unsigned char *dst;
+  long length;
+};
+
+static void worker_blit(struct job_blit *job)
+{
+  memmove(job->dst, job->src, job->length);
+}
+
+static value result_blit(struct job_blit *job)
+{
+  lwt_unix_free_job(&job->job);
+  return Val_unit;
+}
+
+CAMLprim value lwt_unix_blit_job(value val_src, value val_src_ofs, value val_dst, value val_dst_ofs, value val_len)
+{
+  LWT_UNIX_INIT_JOB(job, blit, 0);
+  job->src = Bytes_val(val_src, val_src_ofs);
+  job->dst = Bytes_val(val_dst, val_dst_ofs);
+  job->length = Long_val(val_len);
+  return lwt_unix_alloc_job(&(job->job));
+}
+
+struct job_fill {
+  struct lwt_unix_job job;
+  unsigned char *buffer;
+  long length;
+  int byte;
+};
+
+static void worker_fill(struct job_fill *job)
+{
+  memset(job->buffer, job->byte, job->length);
+}
+
+static value result_fill(struct job_fill *job)
+{
+  lwt_unix_free_job(&job->job);
+  return Val_unit;
+}
+
+CAMLprim value lwt_unix_fill_job(value val_buf, value val_ofs, value val_len, value val_char)
+{
+  LWT_UNIX_INIT_JOB(job, fill, 0);
+  job->buffer = Bytes_val(val_buf, val_ofs);
+  job->length = Long_val(val_len);
+  job->byte = Int_val(val_char);
+  return lwt_unix_alloc_job(&(job->job));
+}
+
+/* +-----------------------------------------------------------------+
+   | Running checksums                                               |
+   +-----------------------------------------------------------------+ */
+
+/* Checksums updated incrementally with the contents of channel
+   buffers. Updates are done on the main thread, one whole buffer at
+   a time. */
+
+struct checksum {
+  /* 0 for CRC32C, 1 for XXH64. */
+  int algorithm;
+  uint32_t crc;
+  struct xxh64_state xxh64;
+};
+
+#define Checksum_val(v) ((struct checksum*)Data_custom_val(v))
+
+static struct custom_operations checksum_ops = {
+  "lwt.bytes.checksum",
+  custom_finalize_default,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value lwt_unix_checksum_create(value val_algorithm, value val_seed)
+{
+  uint64_t seed = Int64_val(val_seed);
+  value result = caml_alloc_custom(&checksum_ops, sizeof(struct checksum), 0, 1);
+  struct checksum *checksum = Checksum_val(result);
+  if (!crc32c_initialized) crc32c_init();
+  checksum->algorithm = Int_val(val_algorithm);
+  checksum->crc = (uint32_t)seed;
+  xxh64_init(&checksum->xxh64, seed);
+  return result;
+}
+
+CAMLprim value lwt_unix_checksum_update(value val_checksum, value val_buf, value val_ofs, value val_len)
+{
+  struct checksum *checksum = Checksum_val(val_checksum);
+  if (checksum->algorithm == 0)
+    checksum->crc = crc32c(checksum->crc, Bytes_val(val_buf, val_ofs), Long_val(val_len));
+  else
+    xxh64_update(&checksum->xxh64, Bytes_val(val_buf, val_ofs), Long_val(val_len));
+  return Val_unit;
+}
+
+CAMLprim value lwt_unix_checksum_digest(value val_checksum)
+{
+  struct checksum *checksum = Checksum_val(val_checksum);
+  if (checksum->algorithm == 0)
+    return caml_copy_int64(checksum->crc);
+  else
+    return caml_copy_int64(xxh64_digest(&checksum->xxh64));
+}
@@ -31,6 +31,8 @@ type _event = {
   (* The stop method of the event. *)
   node : Obj.t Lwt_sequence.node;
   (* The node in the sequence of registered events. *)
+  modify : bool -> bool -> unit;
+  (* Changes the interest of io events. *)
 }
 
 type event = _event ref
@@ -42,13 +44,142 @@ let stop_event ev =
   Lwt_sequence.remove ev.node;
   Lazy.force ev.stop
 
+let modify_io ev readable writable = (!ev).modify readable writable
+
+let not_io readable writable = invalid_arg "Lwt_engine.modify_io"
+
 let _fake_event = {
   stop = lazy ();
   node = Lwt_sequence.add_l (Obj.repr ()) (Lwt_sequence.create ());
+  modify = (fun readable writable -> ());
 }
 
 let fake_event = ref _fake_event
 
+(* +-----------------------------------------------------------------+
+   | Time                                                            |
+   +-----------------------------------------------------------------+ *)
+
+external monotonic_time : unit -> float = "lwt_unix_monotonic_time"
+
+(* The clock of the current engine. *)
+let clock = ref monotonic_time
+
+(* The time of the current iteration of the main loop, as returned by
+   [!clock]. *)
+let current_time = ref (monotonic_time ())
+
+(* Whether the engine updated the time during the current
+   iteration. *)
+let time_updated = ref false
+
+let update_time () =
+  current_time := !clock ();
+  time_updated := true
+
+let now () = !current_time
+
+(* Whether the main loop is inside [iter], waiting for events or
+   running their callbacks. *)
+let in_iteration = ref false
+
+let refresh_time () =
+  if not !in_iteration then update_time ()
+
+(* +-----------------------------------------------------------------+
+   | Statistics                                                      |
+   +-----------------------------------------------------------------+ *)
+
+type stats = {
+  iterations : int;
+  blocked_time : float;
+  callbacks_time : float;
+  ready_events : int;
+  timers_fired : int;
+  last_ready_events : int;
+}
+
+let iterations = ref 0
+let blocked_time = ref 0.
+let callbacks_time = ref 0.
+
+(* The time at which the last iteration woke up. Callbacks time is
+   counted from it up to the start of the next iteration. *)
+let last_wakeup = ref !current_time
+let ready_events = ref 0
+let timers_fired = ref 0
+let last_ready_events = ref 0
+
+let iteration_count () = !iterations
+
+let stats () = {
+  iterations = !iterations;
+  blocked_time = !blocked_time;
+  callbacks_time = !callbacks_time;
+  ready_events = !ready_events;
+  timers_fired = !timers_fired;
+  last_ready_events = !last_ready_events;
+}
+
+(* +-----------------------------------------------------------------+
+   | Monitoring of callbacks                                         |
+   +-----------------------------------------------------------------+ *)
+
+let label_key = Lwt.new_key ()
+
+let monitor_threshold = ref 0.
+let monitor_hook = ref (fun source label duration -> ())
+
+let set_callback_monitor threshold f =
+  monitor_threshold := threshold;
+  monitor_hook := f
+
+#if windows
+let describe_fd kind fd = kind
+#else
+let describe_fd kind fd = Printf.sprintf "%s fd %d" kind (Obj.magic (fd : Unix.file_descr) : int)
+#endif
+
+(* [monitored describe label f x] calls [f x] and reports it if it
+   takes more than the threshold. It must only be called when
+   monitoring is enabled. Callbacks of events check the threshold
+   each time they are called, so events registered before monitoring
+   is enabled are monitored too, and nothing is allocated when it is
+   disabled. [describe] builds the description of the event; it is
+   only called when a stall is reported. *)
+let monitored describe label f x =
+  let start = monotonic_time () in
+  let check () =
+    let duration = monotonic_time () -. start in
+    if !monitor_threshold > 0. && duration >= !monitor_threshold then
+      !monitor_hook (describe ()) label duration
+  in
+  (try f x with exn -> check (); raise exn);
+  check ()
+
+(* +-----------------------------------------------------------------+
+   | Timers coalescing                                               |
+   +-----------------------------------------------------------------+ *)
+
+(* Timers with a slack are grouped by bucket: a bucket is identified
+   by its granularity, the biggest power of two not greater than the
+   slack, and the time at which it fires, which is the first multiple
+   of the granularity after the deadline. So timers are fired at most
+   [slack] seconds after their deadline, and all timers of the same
+   bucket share the same backend timer. *)
+
+type bucket = {
+  callbacks : (unit -> unit) Lwt_sequence.t;
+  (* Callbacks of timers of the bucket. *)
+
+  mutable backend : unit Lazy.t;
+  (* Stops the backend timer of the bucket. *)
+}
+
+let granularity slack =
+  let _, exponent = frexp slack in
+  ldexp 1. (exponent - 1)
+
 (* +-----------------------------------------------------------------+
    | Engines                                                         |
    +-----------------------------------------------------------------+ *)
@@ -68,48 +199,174 @@ class virtual abstract = object(self)
     (* Sequence of callbacks waiting for a file descriptor to become
        writable. *)
 
+  val ios = Lwt_sequence.create ()
+    (* Sequence of callbacks waiting for a file descriptor to become
+       readable or writable. *)
+
   val timers = Lwt_sequence.create ()
     (* Sequence of timers. *)
 
+  val buckets : (float * float, bucket) Hashtbl.t = Hashtbl.create 16
+    (* Buckets of timers with a slack, indexed by granularity and
+       firing time. *)
+
   method destroy =
     Lwt_sequence.iter_l (fun (fd, f, g, ev) -> stop_event ev) readables;
     Lwt_sequence.iter_l (fun (fd, f, g, ev) -> stop_event ev) writables;
-    Lwt_sequence.iter_l (fun (delay, repeat, f, g, ev) -> stop_event ev) timers;
+    Lwt_sequence.iter_l (fun (fd, reading, writing, f, g, ev) -> stop_event ev) ios;
+    Lwt_sequence.iter_l (fun (delay, slack, repeat, f, g, ev) -> stop_event ev) timers;
     self#cleanup
 
   method transfer (engine : abstract) =
     Lwt_sequence.iter_l (fun (fd, f, g, ev) -> stop_event ev; ev := !(engine#on_readable fd f)) readables;
     Lwt_sequence.iter_l (fun (fd, f, g, ev) -> stop_event ev; ev := !(engine#on_writable fd f)) writables;
-    Lwt_sequence.iter_l (fun (delay, repeat, f, g, ev) -> stop_event ev; ev := !(engine#on_timer delay repeat f)) timers
+    Lwt_sequence.iter_l
+      (fun (fd, reading, writing, f, g, ev) ->
+         let readable = !reading and writable = !writing in
+         stop_event ev;
+         ev := !(engine#on_io fd readable writable f))
+      ios;
+    Lwt_sequence.iter_l (fun (delay, slack, repeat, f, g, ev) -> stop_event ev; ev := !(engine#on_timer ~slack delay repeat f)) timers
+
+  method clock = monotonic_time ()
 
   method fake_io fd =
     Lwt_sequence.iter_l (fun (fd', f, g, stop) -> if fd = fd' then g ()) readables;
-    Lwt_sequence.iter_l (fun (fd', f, g, stop) -> if fd = fd' then g ()) writables
+    Lwt_sequence.iter_l (fun (fd', f, g, stop) -> if fd = fd' then g ()) writables;
+    Lwt_sequence.iter_l (fun (fd', reading, writing, f, g, stop) -> if fd = fd' then g !reading !writing) ios
+
+  val mutable readable_count = 0
+  val mutable writable_count = 0
+  val mutable timer_count = 0
+    (* Number of registered events of each kind. *)
 
   method on_readable fd f =
     let ev = ref _fake_event in
-    let g () = f ev in
+    (* The label of the thread registering the event. *)
+    let label = Lwt.get label_key in
+    let g () =
+      incr ready_events;
+      if !monitor_threshold > 0. then monitored (fun () -> describe_fd "readable" fd) label f ev else f ev
+    in
     let stop = self#register_readable fd g in
-    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (fd, f, g, ev) readables) };
+    readable_count <- readable_count + 1;
+    let stop = lazy(readable_count <- readable_count - 1; Lazy.force stop) in
+    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (fd, f, g, ev) readables); modify = not_io };
     ev
 
   method on_writable fd f =
     let ev = ref _fake_event in
-    let g () = f ev in
+    let label = Lwt.get label_key in
+    let g () =
+      incr ready_events;
+      if !monitor_threshold > 0. then monitored (fun () -> describe_fd "writable" fd) label f ev else f ev
+    in
     let stop = self#register_writable fd g in
-    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (fd, f, g, ev) writables) } ;
+    writable_count <- writable_count + 1;
+    let stop = lazy(writable_count <- writable_count - 1; Lazy.force stop) in
+    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (fd, f, g, ev) writables); modify = not_io };
     ev
 
-  method on_timer delay repeat f =
+  method on_timer ?(slack=0.) delay repeat f =
+    (* Outside of callbacks of events, the time may be stale, for
+       example after a long computation, and the timer would fire
+       too early. *)
+    refresh_time ();
     let ev = ref _fake_event in
-    let g () = f ev in
-    let stop = self#register_timer delay repeat g in
-    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (delay, repeat, f, g, ev) timers) };
+    let label = Lwt.get label_key in
+    let g () =
+      incr timers_fired;
+      if !monitor_threshold > 0. then monitored (fun () -> Printf.sprintf "timer (%gs)" delay) label f ev else f ev
+    in
+    let stop =
+      if slack > 0. && not repeat then
+        self#register_coalesced_timer delay slack g
+      else
+        self#register_timer delay repeat g
+    in
+    timer_count <- timer_count + 1;
+    let stop = lazy(timer_count <- timer_count - 1; Lazy.force stop) in
+    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (delay, slack, repeat, f, g, ev) timers); modify = not_io };
     ev
 
-  method readable_count = Lwt_sequence.length readables
-  method writable_count = Lwt_sequence.length writables
-  method timer_count = Lwt_sequence.length timers
+  method on_io fd readable writable f =
+    let ev = ref _fake_event in
+    let label = Lwt.get label_key in
+    let g readable writable =
+      incr ready_events;
+      if !monitor_threshold > 0. then
+        monitored (fun () -> describe_fd "io" fd) label (fun () -> f ev readable writable) ()
+      else
+        f ev readable writable
+    in
+    let modify, stop = self#register_io fd readable writable g in
+    let reading = ref readable and writing = ref writable and active = ref true in
+    if readable then readable_count <- readable_count + 1;
+    if writable then writable_count <- writable_count + 1;
+    let modify readable writable =
+      if !active && (readable <> !reading || writable <> !writing) then begin
+        if readable <> !reading then readable_count <- readable_count + (if readable then 1 else -1);
+        if writable <> !writing then writable_count <- writable_count + (if writable then 1 else -1);
+        reading := readable;
+        writing := writable;
+        modify readable writable
+      end
+    in
+    let stop = lazy(active := false;
+                    if !reading then readable_count <- readable_count - 1;
+                    if !writing then writable_count <- writable_count - 1;
+                    Lazy.force stop) in
+    ev := { stop = stop; node = cast_node (Lwt_sequence.add_r (fd, reading, writing, f, g, ev) ios); modify = modify };
+    ev
+
+  (* Default implementation of io watchers, on top of readable and
+     writable ones. *)
+  method private register_io fd readable writable f =
+    let stop_readable = ref None and stop_writable = ref None in
+    let on_readable () = f true false and on_writable () = f false true in
+    let modify readable writable =
+      (match readable, !stop_readable with
+         | true, None -> stop_readable := Some(self#register_readable fd on_readable)
+         | false, Some stop -> stop_readable := None; Lazy.force stop
+         | _ -> ());
+      (match writable, !stop_writable with
+         | true, None -> stop_writable := Some(self#register_writable fd on_writable)
+         | false, Some stop -> stop_writable := None; Lazy.force stop
+         | _ -> ())
+    in
+    modify readable writable;
+    (modify, lazy(modify false false))
+
+  method private register_coalesced_timer delay slack f =
+    let gran = granularity slack in
+    let time = ceil ((now () +. delay) /. gran) *. gran in
+    let key = (gran, time) in
+    let bucket =
+      try
+        Hashtbl.find buckets key
+      with Not_found ->
+        let bucket = { callbacks = Lwt_sequence.create (); backend = lazy () } in
+        Hashtbl.add buckets key bucket;
+        bucket.backend <-
+          self#register_timer (max 0. (time -. now ())) false
+            (fun () ->
+               Hashtbl.remove buckets key;
+               Lwt_sequence.iter_l (fun f -> f ()) bucket.callbacks);
+        bucket
+    in
+    let node = Lwt_sequence.add_r f bucket.callbacks in
+    lazy(Lwt_sequence.remove node;
+         (* Stop the backend timer if this was the last timer of the
+            bucket and the bucket has not yet fired. *)
+         if Lwt_sequence.is_empty bucket.callbacks
+           && (try Hashtbl.find buckets key == bucket with Not_found -> false) then begin
+           Hashtbl.remove buckets key;
+           Lazy.force bucket.backend
+         end)
+
+  method readable_count = readable_count
+  method writable_count = writable_count
+  method timer_count = timer_count
 end
 
 class type t = object
@@ -135,9 +392,12 @@ type ev_timer
 external ev_init : unit -> ev_loop = "lwt_libev_init"
 external ev_stop : ev_loop -> unit = "lwt_libev_stop"
 external ev_loop : ev_loop -> bool -> unit = "lwt_libev_loop"
+external ev_invoke_pending : ev_loop -> unit = "lwt_libev_invoke_pending"
 external ev_unloop : ev_loop -> unit = "lwt_libev_unloop"
 external ev_readable_init : ev_loop -> Unix.file_descr -> (unit -> unit) -> ev_io = "lwt_libev_readable_init"
 external ev_writable_init : ev_loop -> Unix.file_descr -> (unit -> unit) -> ev_io = "lwt_libev_writable_init"
+external ev_io_init : ev_loop -> Unix.file_descr -> bool -> bool -> (bool -> bool -> unit) -> ev_io = "lwt_libev_io_init"
+external ev_io_modify : ev_loop -> ev_io -> bool -> bool -> unit = "lwt_libev_io_modify"
 external ev_io_stop : ev_loop -> ev_io -> unit = "lwt_libev_io_stop"
 external ev_timer_init : ev_loop -> float -> bool -> (unit -> unit) -> ev_timer = "lwt_libev_timer_init"
 external ev_timer_stop : ev_loop -> ev_timer -> unit  = "lwt_libev_timer_stop"
@@ -152,7 +412,11 @@ class libev = object
 
   method iter block =
     try
-      ev_loop loop block
+      ev_loop loop block;
+      (* Update the time before calling callbacks, so they see the
+         time at which they were woken up. *)
+      update_time ();
+      ev_invoke_pending loop
     with exn ->
       ev_unloop loop;
       raise exn
@@ -165,6 +429,12 @@ class libev = object
     let ev = ev_writable_init loop fd f in
     lazy(ev_io_stop loop ev)
 
+  (* Use only one watcher for both directions. *)
+  method private register_io fd readable writable f =
+    let ev = ev_io_init loop fd readable writable f in
+    ((fun readable writable -> ev_io_modify loop ev readable writable),
+     lazy(ev_io_stop loop ev))
+
   method private register_timer delay repeat f =
     let ev = ev_timer_init loop delay repeat f in
     lazy(ev_timer_stop loop ev)
@@ -188,48 +458,378 @@ end
 
 #endif
 
+(* +-----------------------------------------------------------------+
+   | Timer wheel                                                     |
+   +-----------------------------------------------------------------+ *)
+
+(* Hierarchical timing wheel used by the select/poll engines.
+
+   Time is divided into ticks of one millisecond, counted from
+   [base]. The wheel has [levels] levels of [slot_count] slots; level
+   [l] holds timers expiring in less than [slot_count^(l+1)] ticks,
+   each slot of level [l] covering [slot_count^l] ticks. When the
+   current tick crosses the boundary of a slot of level [l > 0], the
+   timers of this slot are redistributed (cascaded) into lower
+   levels. Timers of level 0 expire exactly at the tick of their
+   slot.
+
+   Adding and removing a timer are O(1): slots are sequences and each
+   timer knows its node. *)
+
+module Timer_wheel = struct
+  let bits = 6
+  let slot_count = 1 lsl bits
+  let mask = slot_count - 1
+  let levels = 5
+
+  (* Timers further than this are put in the last slot that can hold
+     them, and rescheduled when they reach it. This also keeps ticks
+     representable on 32 bits platforms. *)
+  let max_delta = 1 lsl 29 - 1
+
+  (* When the current tick reaches this value, the origin of ticks is
+     moved forward by this amount. Since it is a multiple of the size
+     of slots of the last level, only the slots of the last level have
+     to be rotated. *)
+  let rebase_ticks = 1 lsl 29
+
+  type timer = {
+    mutable deadline : float;
+    (* The time at which the timer expires. *)
+
+    mutable level : int;
+    (* The level of the wheel containing the timer, or [-1] if it is
+       not in a slot. *)
+
+    mutable node : timer Lwt_sequence.node;
+    (* The node of the timer in its slot or list. *)
+
+    action : unit -> unit;
+    (* The action to execute when the timer expires. *)
+  }
+
+  type t = {
+    slots : timer Lwt_sequence.t array array;
+    (* [slots.(level).(index)] *)
+
+    counts : int array;
+    (* Number of timers in each level. *)
+
+    mutable size : int;
+    (* Number of timers in all slots. *)
+
+    mutable base : float;
+    (* Time of tick [0]. *)
+
+    mutable current : int;
+    (* The next tick to process. *)
+
+    expired : timer Lwt_sequence.t;
+    (* Timers that were already expired when added. *)
+
+    pending : timer Lwt_sequence.t;
+    (* Timers added while the wheel is being advanced. They are added
+       at the end, so timers added by actions are not executed
+       immediately. *)
+
+    mutable advancing : bool;
+    (* Whether the wheel is being advanced. *)
+  }
+
+  let dummy_node : timer Lwt_sequence.node = Obj.magic (Lwt_sequence.add_r () (Lwt_sequence.create ()))
+
+  let create now = {
+    slots = Array.init levels (fun _ -> Array.init slot_count (fun _ -> Lwt_sequence.create ()));
+    counts = Array.make levels 0;
+    size = 0;
+    base = now;
+    current = 0;
+    expired = Lwt_sequence.create ();
+    pending = Lwt_sequence.create ();
+    advancing = false;
+  }
+
+  (* Returns the first tick at which [deadline] is reached, as a
+     float. *)
+  let tick_of w deadline = ceil ((deadline -. w.base) *. 1000.)
+
+  let rec level_of_delta delta level =
+    if level = levels - 1 || delta < 1 lsl (bits * (level + 1)) then
+      level
+    else
+      level_of_delta delta (level + 1)
+
+  (* Put a timer in the slots, without checking [advancing]. *)
+  let insert w timer =
+    let delta = tick_of w timer.deadline -. float w.current in
+    if delta < 0. then begin
+      timer.level <- -1;
+      timer.node <- Lwt_sequence.add_r timer w.expired
+    end else begin
+      let delta = if delta >= float max_delta then max_delta else int_of_float delta in
+      let tick = w.current + delta in
+      let level = level_of_delta delta 0 in
+      timer.level <- level;
+      w.counts.(level) <- w.counts.(level) + 1;
+      w.size <- w.size + 1;
+      timer.node <- Lwt_sequence.add_r timer w.slots.(level).((tick lsr (bits * level)) land mask)
+    end
+
+  let add w timer =
+    if w.advancing then begin
+      timer.level <- -1;
+      timer.node <- Lwt_sequence.add_r timer w.pending
+    end else
+      insert w timer
+
+  let remove w timer =
+    Lwt_sequence.remove timer.node;
+    if timer.level >= 0 then begin
+      w.counts.(timer.level) <- w.counts.(timer.level) - 1;
+      w.size <- w.size - 1;
+      timer.level <- -1
+    end
+
+  (* Take the first timer of [seq]. *)
+  let take w seq =
+    match Lwt_sequence.take_opt_l seq with
+      | Some timer ->
+          if timer.level >= 0 then begin
+            w.counts.(timer.level) <- w.counts.(timer.level) - 1;
+            w.size <- w.size - 1;
+            timer.level <- -1
+          end;
+          Some timer
+      | None ->
+          None
+
+  let rec cascade w level =
+    let index = (w.current lsr (bits * level)) land mask in
+    let seq = w.slots.(level).(index) in
+    let rec loop () =
+      match take w seq with
+        | Some timer ->
+            insert w timer;
+            loop ()
+        | None ->
+            ()
+    in
+    loop ();
+    (* Cascade the next level if we crossed one of its slots. *)
+    if index = 0 && level + 1 < levels then cascade w (level + 1)
+
+  (* Process the tick [w.current]. *)
+  let process_tick w =
+    let tick = w.current in
+    if tick land mask = 0 then cascade w 1;
+    let seq = w.slots.(0).(tick land mask) in
+    let rec loop () =
+      match take w seq with
+        | Some timer ->
+            if tick_of w timer.deadline > float tick then
+              (* Timer that was too far to be put at its exact
+                 position. *)
+              insert w timer
+            else
+              timer.action ();
+            loop ()
+        | None ->
+            ()
+    in
+    loop ();
+    w.current <- tick + 1
+
+  let rebase w =
+    w.base <- w.base +. float rebase_ticks /. 1000.;
+    w.current <- w.current - rebase_ticks;
+    let slots = w.slots.(levels - 1) and half = slot_count / 2 in
+    for i = 0 to half - 1 do
+      let seq = slots.(i) in
+      slots.(i) <- slots.(i + half);
+      slots.(i + half) <- seq
+    done
+
+  (* Number of empty levels, starting from level 0. *)
+  let empty_levels w =
+    let rec loop level =
+      if level < levels && w.counts.(level) = 0 then loop (level + 1) else level
+    in
+    loop 0
+
+  let rec advance_to w now =
+    if w.current >= rebase_ticks then rebase w;
+    let target = (now -. w.base) *. 1000. in
+    if float w.current <= target then begin
+      let target = if target >= float rebase_ticks then rebase_ticks else int_of_float target in
+      match empty_levels w with
+        | 0 ->
+            process_tick w;
+            advance_to w now
+        | n ->
+            (* Nothing happens before the next tick which is a
+               multiple of the size of slots of level [n], so we can
+               jump directly to it. *)
+            let next =
+              if n = levels then
+                rebase_ticks
+              else
+                let step = 1 lsl (bits * n) in
+                (w.current + step - 1) land (lnot (step - 1))
+            in
+            if next = w.current then
+              process_tick w
+            else
+              w.current <- min next (target + 1);
+            advance_to w now
+    end
+
+  let flush_pending w =
+    w.advancing <- false;
+    let rec loop () =
+      match Lwt_sequence.take_opt_l w.pending with
+        | Some timer ->
+            insert w timer;
+            loop ()
+        | None ->
+            ()
+    in
+    loop ()
+
+  (* Execute all expired timers. *)
+  let advance w now =
+    w.advancing <- true;
+    try
+      let rec loop () =
+        match take w w.expired with
+          | Some timer ->
+              timer.action ();
+              loop ()
+          | None ->
+              ()
+      in
+      loop ();
+      advance_to w now;
+      flush_pending w
+    with exn ->
+      flush_pending w;
+      raise exn
+
+  (* First tick of the first slot of [level] which has not yet been
+     cascaded. Timers of [level] and above cannot expire before it. *)
+  let boundary w level =
+    let step = 1 lsl (bits * level) in
+    (w.current + step - 1) land (lnot (step - 1))
+
+  (* Returns the first tick, as a float, of the first non-empty slot
+     of [level], or [infinity]. For level [0] this is the tick at
+     which the next timer expires. For other levels it is a lower
+     bound: the slot is cascaded at this tick. Only slots are looked
+     at, never the timers they contain, so this does not depend on
+     the number of timers. *)
+  let next_tick w level =
+    if w.counts.(level) = 0 then
+      infinity
+    else begin
+      let shift = bits * level in
+      let base = boundary w level lsr shift in
+      let rec loop k =
+        if k = slot_count then
+          infinity
+        else if Lwt_sequence.is_empty w.slots.(level).((base + k) land mask) then
+          loop (k + 1)
+        else
+          float ((base + k) lsl shift)
+      in
+      loop 0
+    end
+
+  (* Returns the delay until the next timer expires or the next
+     cascade that may produce one, [0.] if some timers already have
+     expired, or [-1.] if there is no timer. *)
+  let next_timeout w now =
+    if not (Lwt_sequence.is_empty w.expired) then
+      0.
+    else if w.size = 0 then
+      -1.
+    else begin
+      (* Levels above [level] cannot give anything before the
+         boundary of [level], so we stop as soon as we have
+         something earlier. *)
+      let rec loop level best =
+        if level = levels || best <= float (boundary w level) then
+          best
+        else
+          loop (level + 1) (min best (next_tick w level))
+      in
+      max 0. (w.base +. loop 0 infinity /. 1000. -. now)
+    end
+end
+
 (* +-----------------------------------------------------------------+
    | Select/poll based engines                                       |
    +-----------------------------------------------------------------+ *)
 
-(* Type of a sleeper for the select engine. *)
-type sleeper = {
-  mutable time : float;
-  (* The time at which the sleeper should be wakeup. *)
+(* Tables indexed by file descriptors. On Unix, file descriptors are
+   small integers so they are used directly as indices. *)
+module Fd_table : sig
+  type 'a t
+  val create : unit -> 'a t
+  val find : 'a t -> Unix.file_descr -> 'a
+  val add : 'a t -> Unix.file_descr -> 'a -> unit
+  val remove : 'a t -> Unix.file_descr -> unit
+end = struct
+#if windows
+  type 'a t = (Unix.file_descr, 'a) Hashtbl.t
+  let create () = Hashtbl.create 64
+  let find = Hashtbl.find
+  let add = Hashtbl.replace
+  let remove = Hashtbl.remove
+#else
+  type 'a t = { mutable cells : 'a option array }
+
+  let index fd = (Obj.magic (fd : Unix.file_descr) : int)
+
+  let create () = { cells = Array.make 64 None }
+
+  let find t fd =
+    let i = index fd in
+    if i < Array.length t.cells then
+      match t.cells.(i) with
+        | Some x -> x
+        | None -> raise Not_found
+    else
+      raise Not_found
+
+  let add t fd x =
+    let i = index fd in
+    let len = Array.length t.cells in
+    if i >= len then begin
+      let cells = Array.make (max (i + 1) (len * 2)) None in
+      Array.blit t.cells 0 cells 0 len;
+      t.cells <- cells
+    end;
+    t.cells.(i) <- Some x
+
+  let remove t fd =
+    let i = index fd in
+    if i < Array.length t.cells then t.cells.(i) <- None
+#endif
+end
 
-  mutable stopped : bool;
-  (* [true] iff the event has been stopped. *)
+(* Interest of the engine in a file descriptor. *)
+type interest = {
+  fi_fd : Unix.file_descr;
 
-  action : unit -> unit;
-  (* The action for the sleeper. *)
-}
+  mutable fi_index : int;
+  (* Position of the interest in the array of watched file
+     descriptors. *)
 
-module Sleep_queue =
-  Lwt_pqueue.Make(struct
-                    type t = sleeper
-                    let compare { time = t1 } { time = t2 } = compare t1 t2
-                  end)
-
-module Fd_map = Map.Make(struct type t = Unix.file_descr let compare = compare end)
-
-let rec restart_actions sleep_queue now =
-  match Sleep_queue.lookup_min sleep_queue with
-    | Some{ stopped = true } ->
-        restart_actions (Sleep_queue.remove_min sleep_queue) now
-    | Some{ time = time; action = action } when time <= now ->
-        action ();
-        restart_actions (Sleep_queue.remove_min sleep_queue) now
-    | _ ->
-        sleep_queue
-
-let rec get_next_timeout sleep_queue =
-  match Sleep_queue.lookup_min sleep_queue with
-    | Some{ stopped = true } ->
-        get_next_timeout (Sleep_queue.remove_min sleep_queue)
-    | Some{ time = time } ->
-        max 0. (time -. Unix.gettimeofday ())
-    | None ->
-        -1.
+  fi_readable : (unit -> unit) Lwt_sequence.t;
+  (* Actions waiting for the file descriptor to become readable. *)
+
+  fi_writable : (unit -> unit) Lwt_sequence.t;
+  (* Actions waiting for the file descriptor to become writable. *)
+}
 
 let bad_fd fd =
   try
@@ -238,74 +838,111 @@ let bad_fd fd =
   with Unix.Unix_error (_, _, _) ->
     true
 
-let invoke_actions fd map =
-  match try Some(Fd_map.find fd map) with Not_found -> None with
-    | Some actions -> Lwt_sequence.iter_l (fun f -> f ()) actions
-    | None -> ()
+let invoke_actions actions = Lwt_sequence.iter_l (fun f -> f ()) actions
 
 class virtual select_or_poll_based = object(self)
   inherit abstract
 
-  val mutable sleep_queue = Sleep_queue.empty
+  val wheel = Timer_wheel.create (now ())
     (* Threads waiting for a timeout to expire. *)
 
-  val mutable new_sleeps = []
-    (* Sleepers added since the last iteration of the main loop:
+  val interests : interest Fd_table.t = Fd_table.create ()
+    (* Interests of watched file descriptors. *)
 
-       They are not added immediatly to the main sleep queue in order
-       to prevent them from being wakeup immediatly.  *)
+  val mutable watched : interest array = [||]
+    (* Watched file descriptors, in no particular order. Only the
+       first [watched_count] cells are used. *)
 
-  val mutable wait_readable = Fd_map.empty
-    (* Sequences of actions waiting for file descriptors to become
-       readable. *)
+  val mutable watched_count = 0
 
-  val mutable wait_writable = Fd_map.empty
-    (* Sequences of actions waiting for file descriptors to become
-       writable. *)
+  val mutable dirty = true
+    (* Whether the set of watched file descriptors or their interest
+       changed since the last time the arguments of the blocking call
+       were computed. *)
 
   method private cleanup = ()
 
   method private register_timer delay repeat f =
     if repeat then begin
-      let rec sleeper = { time = Unix.gettimeofday () +. delay; stopped = false; action = g }
+      let rec timer = { Timer_wheel.deadline = now () +. delay; level = -1; node = Timer_wheel.dummy_node; action = g }
       and g () =
-        sleeper.time <- Unix.gettimeofday () +. delay;
-        new_sleeps <- sleeper :: new_sleeps;
+        (* Reschedule the timer before calling [f], so [f] can stop
+           it. *)
+        timer.Timer_wheel.deadline <- now () +. delay;
+        Timer_wheel.add wheel timer;
         f ()
       in
-      new_sleeps <- sleeper :: new_sleeps;
-      lazy(sleeper.stopped <- true)
+      Timer_wheel.add wheel timer;
+      lazy(Timer_wheel.remove wheel timer)
     end else begin
-      let sleeper = { time = Unix.gettimeofday () +. delay; stopped = false; action = f } in
-      new_sleeps <- sleeper :: new_sleeps;
-      lazy(sleeper.stopped <- true)
+      let timer = { Timer_wheel.deadline = now () +. delay; level = -1; node = Timer_wheel.dummy_node; action = f } in
+      Timer_wheel.add wheel timer;
+      lazy(Timer_wheel.remove wheel timer)
     end
 
+  (* Returns the timeout for the blocking call. *)
+  method private next_timeout =
+    (* The time has just been refreshed by [Lwt_engine.iter]. *)
+    Timer_wheel.next_timeout wheel (now ())
+
+  method private add_interest fd =
+    let interest = {
+      fi_fd = fd;
+      fi_index = watched_count;
+      fi_readable = Lwt_sequence.create ();
+      fi_writable = Lwt_sequence.create ();
+    } in
+    if watched_count = Array.length watched then begin
+      let array = Array.make (max 64 (watched_count * 2)) interest in
+      Array.blit watched 0 array 0 watched_count;
+      watched <- array
+    end;
+    watched.(watched_count) <- interest;
+    watched_count <- watched_count + 1;
+    Fd_table.add interests fd interest;
+    interest
+
+  method private remove_interest interest =
+    (* Move the last watched file descriptor in place of the removed
+       one. *)
+    let last = watched_count - 1 in
+    let moved = watched.(last) in
+    watched.(interest.fi_index) <- moved;
+    moved.fi_index <- interest.fi_index;
+    watched_count <- last;
+    Fd_table.remove interests interest.fi_fd
+
+  (* Called when the interest in a file descriptor changes. *)
+  method private update_interest interest =
+    dirty <- true;
+    if Lwt_sequence.is_empty interest.fi_readable && Lwt_sequence.is_empty interest.fi_writable then
+      self#remove_interest interest
+
   method private register_readable fd f =
-    let actions =
-      try
-        Fd_map.find fd wait_readable
-      with Not_found ->
-        let actions = Lwt_sequence.create () in
-        wait_readable <- Fd_map.add fd actions wait_readable;
-        actions
-    in
-    let node = Lwt_sequence.add_l f actions in
+    let interest = try Fd_table.find interests fd with Not_found -> self#add_interest fd in
+    let was_empty = Lwt_sequence.is_empty interest.fi_readable in
+    let node = Lwt_sequence.add_l f interest.fi_readable in
+    if was_empty then self#update_interest interest;
     lazy(Lwt_sequence.remove node;
-         if Lwt_sequence.is_empty actions then wait_readable <- Fd_map.remove fd wait_readable)
+         if Lwt_sequence.is_empty interest.fi_readable then self#update_interest interest)
 
   method private register_writable fd f =
-    let actions =
-      try
-        Fd_map.find fd wait_writable
-      with Not_found ->
-        let actions = Lwt_sequence.create () in
-        wait_writable <- Fd_map.add fd actions wait_writable;
-        actions
-    in
-    let node = Lwt_sequence.add_l f actions in
+    let interest = try Fd_table.find interests fd with Not_found -> self#add_interest fd in
+    let was_empty = Lwt_sequence.is_empty interest.fi_writable in
+    let node = Lwt_sequence.add_l f interest.fi_writable in
+    if was_empty then self#update_interest interest;
     lazy(Lwt_sequence.remove node;
-         if Lwt_sequence.is_empty actions then wait_writable <- Fd_map.remove fd wait_writable)
+         if Lwt_sequence.is_empty interest.fi_writable then self#update_interest interest)
+
+  method private invoke_readable fd =
+    match try Some(Fd_table.find interests fd) with Not_found -> None with
+      | Some interest -> invoke_actions interest.fi_readable
+      | None -> ()
+
+  method private invoke_writable fd =
+    match try Some(Fd_table.find interests fd) with Not_found -> None with
+      | Some interest -> invoke_actions interest.fi_writable
+      | None -> ()
 end
 
 class virtual select_based = object(self)
@@ -313,18 +950,31 @@ class virtual select_based = object(self)
 
   method private virtual select : Unix.file_descr list -> Unix.file_descr list -> float -> Unix.file_descr list * Unix.file_descr list
 
+  val mutable fds_r = []
+  val mutable fds_w = []
+    (* Arguments of [select], recomputed only when [dirty] is set. *)
+
   method iter block =
-    (* Transfer all sleepers added since the last iteration to the
-       main sleep queue: *)
-    sleep_queue <- List.fold_left (fun q e -> Sleep_queue.add e q) sleep_queue new_sleeps;
-    new_sleeps <- [];
     (* Collect file descriptors. *)
-    let fds_r = Fd_map.fold (fun fd _ l -> fd :: l) wait_readable [] in
-    let fds_w = Fd_map.fold (fun fd _ l -> fd :: l) wait_writable [] in
+    if dirty then begin
+      let rec loop i acc_r acc_w =
+        if i = watched_count then begin
+          fds_r <- acc_r;
+          fds_w <- acc_w
+        end else begin
+          let interest = watched.(i) in
+          loop (i + 1)
+            (if Lwt_sequence.is_empty interest.fi_readable then acc_r else interest.fi_fd :: acc_r)
+            (if Lwt_sequence.is_empty interest.fi_writable then acc_w else interest.fi_fd :: acc_w)
+        end
+      in
+      loop 0 [] [];
+      dirty <- false
+    end;
     (* Compute the timeout. *)
-    let timeout = if block then get_next_timeout sleep_queue else 0. in
+    let timeout = if block then self#next_timeout else 0. in
     (* Do the blocking call *)
-    let fds_r, fds_w =
+    let ready_r, ready_w =
       try
         self#select fds_r fds_w timeout
       with
@@ -336,11 +986,12 @@ class virtual select_based = object(self)
             (List.filter bad_fd fds_r,
              List.filter bad_fd fds_w)
     in
+    update_time ();
     (* Restart threads waiting for a timeout: *)
-    sleep_queue <- restart_actions sleep_queue (Unix.gettimeofday ());
+    Timer_wheel.advance wheel (now ());
     (* Restart threads waiting on a file descriptors: *)
-    List.iter (fun fd -> invoke_actions fd wait_readable) fds_r;
-    List.iter (fun fd -> invoke_actions fd wait_writable) fds_w
+    List.iter (fun fd -> self#invoke_readable fd) ready_r;
+    List.iter (fun fd -> self#invoke_writable fd) ready_w
 end
 
 class virtual poll_based = object(self)
@@ -348,19 +999,29 @@ class virtual poll_based = object(self)
 
   method private virtual poll : (Unix.file_descr * bool * bool) list -> float -> (Unix.file_descr * bool * bool) list
 
+  val mutable fds = []
+    (* Argument of [poll], recomputed only when [dirty] is set. *)
+
   method iter block =
-    (* Transfer all sleepers added since the last iteration to the
-       main sleep queue: *)
-    sleep_queue <- List.fold_left (fun q e -> Sleep_queue.add e q) sleep_queue new_sleeps;
-    new_sleeps <- [];
     (* Collect file descriptors. *)
-    let fds = [] in
-    let fds = Fd_map.fold (fun fd _ l -> (fd, true, false) :: l) wait_readable fds in
-    let fds = Fd_map.fold (fun fd _ l -> (fd, false, true) :: l) wait_writable fds in
+    if dirty then begin
+      let rec loop i acc =
+        if i = watched_count then
+          fds <- acc
+        else begin
+          let interest = watched.(i) in
+          loop (i + 1) ((interest.fi_fd,
+                         not (Lwt_sequence.is_empty interest.fi_readable),
+                         not (Lwt_sequence.is_empty interest.fi_writable)) :: acc)
+        end
+      in
+      loop 0 [];
+      dirty <- false
+    end;
     (* Compute the timeout. *)
-    let timeout = if block then get_next_timeout sleep_queue else 0. in
+    let timeout = if block then self#next_timeout else 0. in
     (* Do the blocking call *)
-    let fds =
+    let ready =
       try
         self#poll fds timeout
       with
@@ -371,14 +1032,15 @@ class virtual poll_based = object(self)
                them have to handle the error: *)
             List.filter (fun (fd, _, _) -> bad_fd fd) fds
     in
+    update_time ();
     (* Restart threads waiting for a timeout: *)
-    sleep_queue <- restart_actions sleep_queue (Unix.gettimeofday ());
+    Timer_wheel.advance wheel (now ());
     (* Restart threads waiting on a file descriptors: *)
     List.iter
       (fun (fd, readable, writable) ->
-         if readable then invoke_actions fd wait_readable;
-         if writable then invoke_actions fd wait_writable)
-      fds
+         if readable then self#invoke_readable fd;
+         if writable then self#invoke_writable fd)
+      ready
 end
 
 class select = object
@@ -389,6 +1051,155 @@ class select = object
     (fds_r, fds_w)
 end
 
+(* +-----------------------------------------------------------------+
+   | Virtual time                                                    |
+   +-----------------------------------------------------------------+ *)
+
+class virtual_time = object(self)
+  inherit select_based
+
+  val mutable time = now ()
+
+  val scripted_readable : (Unix.file_descr, unit) Hashtbl.t = Hashtbl.create 16
+  val scripted_writable : (Unix.file_descr, unit) Hashtbl.t = Hashtbl.create 16
+    (* File descriptors marked as ready by the user. *)
+
+  method clock = time
+
+  method advance delta =
+    if delta < 0. then invalid_arg "Lwt_engine.virtual_time#advance";
+    time <- time +. delta;
+    update_time ();
+    Timer_wheel.advance wheel time
+
+  method set_readable fd ready =
+    if ready then Hashtbl.replace scripted_readable fd () else Hashtbl.remove scripted_readable fd
+
+  method set_writable fd ready =
+    if ready then Hashtbl.replace scripted_writable fd () else Hashtbl.remove scripted_writable fd
+
+  method private select fds_r fds_w timeout =
+    let scripted_r = List.filter (Hashtbl.mem scripted_readable) fds_r
+    and scripted_w = List.filter (Hashtbl.mem scripted_writable) fds_w in
+    if scripted_r <> [] || scripted_w <> [] then
+      (scripted_r, scripted_w)
+    else begin
+      (* Real file descriptors are still checked, but we only block
+         on them if there is no timer at all. *)
+      let ready_r, ready_w, _ = Unix.select fds_r fds_w [] (if timeout < 0. then -1. else 0.) in
+      if ready_r = [] && ready_w = [] && timeout > 0. then
+        (* Jump to the next timer. The extra microsecond makes sure
+           rounding errors do not leave us just before it. *)
+        time <- time +. timeout +. 1e-6;
+      (ready_r, ready_w)
+    end
+end
+
+(* +-----------------------------------------------------------------+
+   | The poll engine                                                 |
+   +-----------------------------------------------------------------+ *)
+
+#if windows
+
+class poll = object
+  inherit select_or_poll_based
+
+  val set : unit = raise (Lwt_sys.Not_available "poll")
+  method iter = assert false
+end
+
+#else
+
+type poll_set
+
+external poll_create : unit -> poll_set = "lwt_unix_poll_create"
+external poll_add : poll_set -> Unix.file_descr -> int = "lwt_unix_poll_add"
+external poll_set_events : poll_set -> int -> bool -> bool -> unit = "lwt_unix_poll_set_events" "noalloc"
+external poll_remove : poll_set -> int -> unit = "lwt_unix_poll_remove" "noalloc"
+external poll_wait : poll_set -> float -> int = "lwt_unix_poll_wait"
+external poll_ready_index : poll_set -> int -> int = "lwt_unix_poll_ready_index" "noalloc"
+external poll_ready_events : poll_set -> int -> int = "lwt_unix_poll_ready_events" "noalloc"
+
+class poll = object(self)
+  inherit select_or_poll_based as super
+
+  val set = poll_create ()
+    (* The pollfd array, kept between iterations. Its [i]th entry
+       is the one of [watched.(i)]. *)
+
+  val mutable dispatching = false
+    (* Whether ready entries are being processed. Entries cannot be
+       moved while this is the case, since ready indices refer to
+       them. *)
+
+  val mutable garbage = []
+    (* Interests that became empty while dispatching. *)
+
+  method private add_interest fd =
+    let _ = poll_add set fd in
+    super#add_interest fd
+
+  method private remove_interest interest =
+    poll_remove set interest.fi_index;
+    super#remove_interest interest
+
+  method private update_interest interest =
+    let readable = not (Lwt_sequence.is_empty interest.fi_readable)
+    and writable = not (Lwt_sequence.is_empty interest.fi_writable) in
+    poll_set_events set interest.fi_index readable writable;
+    if not (readable || writable) then begin
+      if dispatching then
+        garbage <- interest :: garbage
+      else
+        self#remove_interest interest
+    end
+
+  method private collect =
+    let l = garbage in
+    garbage <- [];
+    List.iter
+      (fun interest ->
+         if Lwt_sequence.is_empty interest.fi_readable
+           && Lwt_sequence.is_empty interest.fi_writable
+           && (try Fd_table.find interests interest.fi_fd == interest with Not_found -> false) then
+           self#remove_interest interest)
+      l
+
+  method private dispatch ready =
+    (* Restart threads waiting for a timeout: *)
+    Timer_wheel.advance wheel (now ());
+    (* Restart threads waiting on a file descriptors: *)
+    for i = 0 to ready - 1 do
+      let interest = watched.(poll_ready_index set i) in
+      let events = poll_ready_events set i in
+      if events land 1 <> 0 then invoke_actions interest.fi_readable;
+      if events land 2 <> 0 then invoke_actions interest.fi_writable
+    done
+
+  method iter block =
+    (* Compute the timeout. *)
+    let timeout = if block then self#next_timeout else 0. in
+    (* Do the blocking call *)
+    let ready =
+      try
+        poll_wait set timeout
+      with Unix.Unix_error (Unix.EINTR, _, _) ->
+        0
+    in
+    update_time ();
+    dispatching <- true;
+    (try
+       self#dispatch ready
+     with exn ->
+       dispatching <- false;
+       self#collect;
+       raise exn);
+    dispatching <- false;
+    self#collect
+end
+
+#endif
+
 (* +-----------------------------------------------------------------+
    | The current engine                                              |
    +-----------------------------------------------------------------+ *)
@@ -407,14 +1218,43 @@ let get () =
   !current
 
 let set ?(transfer=true) ?(destroy=true) engine =
+  (* Switch the clock first, so transferred timers are relative to
+     the clock of the new engine. *)
+  clock := (fun () -> engine#clock);
+  current_time := engine#clock;
+  last_wakeup := !current_time;
   if transfer then !current#transfer (engine : #t :> abstract);
   if destroy then !current#destroy;
   current := (engine : #t :> t)
 
-let iter block = !current#iter block
+let iter block =
+  (* Refresh the time, so the engine computes its timeout from it.
+     The time since the previous wakeup was spent in callbacks. *)
+  update_time ();
+  let start = !current_time in
+  callbacks_time := !callbacks_time +. (start -. !last_wakeup);
+  let events = !ready_events + !timers_fired in
+  time_updated := false;
+  in_iteration := true;
+  (try
+     !current#iter block
+   with exn ->
+     in_iteration := false;
+     raise exn);
+  in_iteration := false;
+  (* Engines update the time just after waiting for events, which
+     separates time spent blocked from time spent in callbacks. For
+     engines not maintaining the time themselves, callbacks of this
+     iteration are counted as blocked. *)
+  if not !time_updated then update_time ();
+  incr iterations;
+  blocked_time := !blocked_time +. (!current_time -. start);
+  last_wakeup := !current_time;
+  last_ready_events := !ready_events + !timers_fired - events
 let on_readable fd f = !current#on_readable fd f
 let on_writable fd f = !current#on_writable fd f
-let on_timer delay repeat f = !current#on_timer delay repeat f
+let on_io fd readable writable f = !current#on_io fd readable writable f
+let on_timer ?slack delay repeat f = !current#on_timer ?slack delay repeat f
 let fake_io fd = !current#fake_io fd
 let readable_count () = !current#readable_count
 let writable_count () = !current#writable_count
@@ -48,10 +48,31 @@ val on_readable : Unix.file_descr -> (event -> unit) -> event
 val on_writable : Unix.file_descr -> (event -> unit) -> event
   (** [on_readable fd f] calls [f] each time [fd] becomes writable. *)
 
-val on_timer : float -> bool -> (event -> unit) -> event
-  (** [on_timer delay repeat f] calls [f] one time after [delay]
-      seconds. If [repeat] is [true] then [f] is called each [delay]
-      seconds, otherwise it is called only one time. *)
+val on_io : Unix.file_descr -> bool -> bool -> (event -> bool -> bool -> unit) -> event
+  (** [on_io fd readable writable f] watches [fd] for readability if
+      [readable] is [true] and for writability if [writable] is
+      [true]. Each time [fd] becomes ready, [f event readable
+      writable] is called with the ready directions.
+
+      Contrary to using both {!on_readable} and {!on_writable}, only
+      one watcher is used, and the watched directions can be changed
+      with {!modify_io} without stopping it. *)
+
+val modify_io : event -> bool -> bool -> unit
+  (** [modify_io event readable writable] changes the directions
+      watched by an event created by {!on_io}. Watching no direction
+      keeps the event registered but idle. It raises
+      [Invalid_argument] for other events. *)
+
+val on_timer : ?slack : float -> float -> bool -> (event -> unit) -> event
+  (** [on_timer ?slack delay repeat f] calls [f] one time after
+      [delay] seconds. If [repeat] is [true] then [f] is called each
+      [delay] seconds, otherwise it is called only one time.
+
+      If [slack] is given and [repeat] is [false], [f] may be called
+      up to [slack] seconds later than requested. This allows the
+      engine to group timers expiring at about the same time so they
+      share the same underlying timer and wakeup. *)
 
 val readable_count : unit -> int
   (** Returns the number of events waiting for a file descriptor to
@@ -64,9 +85,88 @@ val writable_count : unit -> int
 val timer_count : unit -> int
   (** Returns the number of registered timers. *)
 
+(** Statistics about the main loop. All counters are cumulative since
+    the start of the program, except [last_ready_events]. *)
+type stats = {
+  iterations : int;
+  (** Number of iterations of the main loop. *)
+
+  blocked_time : float;
+  (** Time, in seconds, spent waiting for events. *)
+
+  callbacks_time : float;
+  (** Time, in seconds, spent between two waits for events: running
+      callbacks of events and the rest of the main loop. *)
+
+  ready_events : int;
+  (** Number of times a file descriptor was reported as ready. *)
+
+  timers_fired : int;
+  (** Number of timers that expired. *)
+
+  last_ready_events : int;
+  (** Number of file descriptors and timers that were ready during
+      the last iteration. *)
+}
+
+val stats : unit -> stats
+  (** [stats ()] returns statistics about the main loop. They are
+      maintained by {!iter} and by the event methods of {!abstract},
+      so they are available for all engines. *)
+
+val iteration_count : unit -> int
+  (** [iteration_count ()] is [(stats ()).iterations], without
+      allocating. *)
+
 val fake_io : Unix.file_descr -> unit
   (** Simulates activity on the given file descriptor. *)
 
+(** {6 Time} *)
+
+val now : unit -> float
+  (** [now ()] returns the time, in seconds, at which the current
+      iteration of the main loop started. It is read from a monotonic
+      clock when available, so it is not affected by changes of the
+      wall clock, and the origin is unspecified: only differences
+      between two values are meaningful.
+
+      It is updated once per iteration, so it is very cheap but does
+      not advance while callbacks of events are running. Timers
+      registered outside of these callbacks read the clock first, so
+      they never fire early. *)
+
+val update_time : unit -> unit
+  (** [update_time ()] reads the clock of the current engine and
+      updates the value returned by {!now}. Engines call it after
+      waiting for events; custom engines that do not are handled by
+      {!iter}. *)
+
+val refresh_time : unit -> unit
+  (** [refresh_time ()] calls {!update_time} when called outside of
+      {!iter}, for example after a long computation before entering
+      the main loop. Inside, the time has just been updated by the
+      engine, so it does nothing. *)
+
+val monotonic_time : unit -> float
+  (** [monotonic_time ()] reads the monotonic clock directly. *)
+
+(** {6 Monitoring} *)
+
+val label_key : string Lwt.key
+  (** Key used to label events. When monitoring is enabled, the value
+      associated to this key when an event is registered is reported
+      with the slow callbacks of this event. *)
+
+val set_callback_monitor : float -> (string -> string option -> float -> unit) -> unit
+  (** [set_callback_monitor threshold f] makes the engine call [f
+      source label duration] each time a callback of an event takes
+      [threshold] seconds or more. [source] describes the event, for
+      example ["readable fd 5"]. [threshold = 0.] disables
+      monitoring. It applies to all events, including the ones
+      registered before.
+
+      You should rather use {!Lwt_main.set_stall_threshold}. *)
+
 (** {6 Engines} *)
 
 (** An engine represent a set of functions used to register different
@@ -90,11 +190,16 @@ class virtual abstract : object
   method virtual iter : bool -> unit
   method on_readable : Unix.file_descr -> (event -> unit) -> event
   method on_writable : Unix.file_descr -> (event -> unit) -> event
-  method on_timer : float -> bool -> (event -> unit) -> event
+  method on_io : Unix.file_descr -> bool -> bool -> (event -> bool -> bool -> unit) -> event
+  method on_timer : ?slack : float -> float -> bool -> (event -> unit) -> event
   method fake_io : Unix.file_descr -> unit
+  method clock : float
+    (** Reads the clock of the engine. The default is
+        {!monotonic_time}. *)
   method readable_count : int
   method writable_count : int
   method timer_count : int
+    (** Number of registered events. These are O(1). *)
 
   (** {6 Backend methods} *)
 
@@ -112,6 +217,13 @@ class virtual abstract : object
   method virtual private register_readable : Unix.file_descr -> (unit -> unit) -> unit Lazy.t
   method virtual private register_writable : Unix.file_descr -> (unit -> unit) -> unit Lazy.t
   method virtual private register_timer : float -> bool -> (unit -> unit) -> unit Lazy.t
+
+  method private register_io : Unix.file_descr -> bool -> bool -> (bool -> bool -> unit) -> (bool -> bool -> unit) * unit Lazy.t
+    (** [register_io fd readable writable f] registers a watcher for
+        both directions. It returns a function to change the watched
+        directions and the lazy value unregistering the watcher. The
+        default implementation uses [register_readable] and
+        [register_writable]. *)
 end
 
 (** Type of engines. *)
@@ -145,6 +257,39 @@ end
 (** Engine based on [Unix.select]. *)
 class select : t
 
+(** Engine based on poll(2). Unlike {!poll_based}, the array of
+    [struct pollfd] is kept between iterations and only updated when
+    the set of watched file descriptors changes, and ready file
+    descriptors are retrieved without allocating. It is not
+    available on Windows, where the creation of the class raises
+    {!Lwt_sys.Not_available}. *)
+class poll : t
+
+(** Engine with a virtual clock, for testing. It behaves like
+    {!select}, except that instead of blocking until the next timer
+    expires, it advances its clock directly to it. So sleeping
+    threads are woken up immediately, in the right order, and {!now}
+    returns the time they would have been woken up at.
+
+    Real file descriptors are still checked, but the engine only
+    blocks on them if there is no timer at all. File descriptors can
+    also be marked as ready manually. *)
+class virtual_time : object
+  inherit t
+
+  method advance : float -> unit
+    (** [advance delta] moves the clock forward by [delta] seconds
+        and runs expired timers. *)
+
+  method set_readable : Unix.file_descr -> bool -> unit
+    (** [set_readable fd ready] marks [fd] as readable or not. While
+        marked, actions waiting for [fd] to become readable are run
+        at each iteration, whatever the actual state of [fd] is. *)
+
+  method set_writable : Unix.file_descr -> bool -> unit
+    (** Same as [set_readable] for writability. *)
+end
+
 (** Abstract class for engines based on a select-like function. *)
 class virtual select_based : object
   inherit t
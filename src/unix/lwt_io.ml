@@ -57,6 +57,15 @@ type 'a mode =
 let input : input mode = Input
 let output : output mode = Output
 
+type checksum_algorithm = Crc32c | Xxh64
+
+(* State of a running checksum, allocated by the C stubs. *)
+type checksum_state
+
+external checksum_create : checksum_algorithm -> int64 -> checksum_state = "lwt_unix_checksum_create"
+external checksum_update : checksum_state -> Lwt_bytes.t -> int -> int -> unit = "lwt_unix_checksum_update" "noalloc"
+external checksum_digest : checksum_state -> int64 = "lwt_unix_checksum_digest"
+
 (* A channel state *)
 type 'mode state =
   | Busy_primitive
@@ -123,6 +132,10 @@ and 'mode _channel = {
 
   typ : typ;
   (* Type of the channel. *)
+
+  mutable checksums : checksum_state list;
+  (* Running checksums updated with the data transferred by
+     [perform_io]. *)
 }
 
 and typ =
@@ -206,12 +219,21 @@ let perform_io ch = match ch.main.state with
               | Input ->
                   (* Size of data in the buffer *)
                   let size = ch.max - ch.ptr in
-                  (* If there are still data in the buffer, keep them: *)
-                  if size > 0 then Lwt_bytes.unsafe_blit ch.buffer ch.ptr ch.buffer 0 size;
-                  (* Update positions: *)
-                  ch.ptr <- 0;
-                  ch.max <- size;
-                  (size, ch.length - size)
+                  if size = 0 then begin
+                    (* Nothing to keep, restart at the beginning of
+                       the buffer: *)
+                    ch.ptr <- 0;
+                    ch.max <- 0
+                  end else if ch.length - ch.max < ch.length / 2 then begin
+                    (* Move remaining data to the beginning of the
+                       buffer only when there is not much room left
+                       after them. This way data consumed in small
+                       pieces are not copied at each refill. *)
+                    Lwt_bytes.unsafe_blit ch.buffer ch.ptr ch.buffer 0 size;
+                    ch.ptr <- 0;
+                    ch.max <- size
+                  end;
+                  (ch.max, ch.length - ch.max)
               | Output ->
                   (0, ch.ptr) in
             lwt n = pick [ch.abort_waiter; perform_io ch.buffer ptr len] in
@@ -222,6 +244,9 @@ let perform_io ch = match ch.main.state with
             else begin
               (* Update the global offset: *)
               ch.offset <- Int64.add ch.offset (Int64.of_int n);
+              (* Update running checksums with the data that have just
+                 been read/written: *)
+              List.iter (fun state -> checksum_update state ch.buffer ptr n) ch.checksums;
               (* Update buffer positions: *)
               begin match ch.mode with
                 | Input ->
@@ -525,6 +550,7 @@ let make ?buffer_size ?(close=return) ?(seek=no_seek) ~mode perform_io =
     mode = mode;
     offset = 0L;
     typ = Type_normal(perform_io, fun pos cmd -> try seek pos cmd with e -> raise_lwt e);
+    checksums = [];
   } and wrapper = {
     state = Idle;
     channel = ch;
@@ -557,6 +583,7 @@ let of_bytes ~mode bytes =
     mode = mode;
     offset = 0L;
     typ = Type_bytes;
+    checksums = [];
   } and wrapper = {
     state = Idle;
     channel = ch;
@@ -653,6 +680,26 @@ let resize_buffer wrapper len =
         in
         primitive f wrapper
 
+(* +-----------------------------------------------------------------+
+   | Checksums                                                       |
+   +-----------------------------------------------------------------+ *)
+
+type checksum = {
+  cs_state : checksum_state;
+  cs_stop : unit -> unit;
+}
+
+let checksum ?(algorithm=Crc32c) ?(seed=0L) wrapper =
+  let ch = wrapper.channel in
+  let state = checksum_create algorithm seed in
+  ch.checksums <- state :: ch.checksums;
+  { cs_state = state;
+    cs_stop = (fun () -> ch.checksums <- List.filter ((!=) state) ch.checksums) }
+
+let checksum_value cs = checksum_digest cs.cs_state
+
+let stop_checksum cs = cs.cs_stop ()
+
 (* +-----------------------------------------------------------------+
    | Byte-order                                                      |
    +-----------------------------------------------------------------+ *)
@@ -783,9 +830,8 @@ struct
     end else begin
       refill ic >>= fun n ->
         let len = min len n in
-        Lwt_bytes.unsafe_blit_bytes_string ic.buffer 0 str ofs len;
-        ic.ptr <- len;
-        ic.max <- n;
+        Lwt_bytes.unsafe_blit_bytes_string ic.buffer ic.ptr str ofs len;
+        ic.ptr <- ic.ptr + len;
         return len
     end
 
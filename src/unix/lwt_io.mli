@@ -212,6 +212,38 @@ val set_position : 'a channel -> int64 -> unit Lwt.t
 val length : 'a channel -> int64 Lwt.t
   (** Returns the length of the channel in bytes *)
 
+(** {6 Checksums} *)
+
+type checksum_algorithm =
+  | Crc32c
+      (** CRC-32 with the Castagnoli polynomial, using the crc32
+          instruction of the cpu when available. The value is in the
+          low 32 bits. *)
+  | Xxh64
+      (** 64-bit xxHash *)
+
+type checksum
+  (** A running checksum of the data transferred by a channel. *)
+
+val checksum : ?algorithm : checksum_algorithm -> ?seed : int64 -> 'a channel -> checksum
+  (** [checksum ?algorithm ?seed ch] starts computing a checksum of
+      all the data transferred between [ch] and its underlying device
+      from now on. [algorithm] defaults to [Crc32c] and [seed] to
+      [0L]; for [Crc32c] the seed is the initial crc.
+
+      The checksum is updated in C with whole buffers, each time the
+      channel is refilled or flushed. This means that for an input
+      channel data already in the buffer are not included, and data
+      are included as soon as they are read from the device, even if
+      they have not yet been consumed. For an output channel data
+      are included only once they have been flushed. *)
+
+val checksum_value : checksum -> int64
+  (** Returns the checksum of the data transferred so far. *)
+
+val stop_checksum : checksum -> unit
+  (** [stop_checksum cs] stops updating [cs]. Its value is kept. *)
+
 (** {6 Reading} *)
 
 (** Note: except for functions dealing with streams ({!read_chars} and
@@ -95,8 +95,14 @@ CAMLprim value lwt_libev_loop(value val_loop, value val_block)
   caml_enter_blocking_section();
   ev_loop(loop, Bool_val(val_block) ? EVLOOP_ONESHOT : EVLOOP_ONESHOT | EVLOOP_NONBLOCK);
   caml_leave_blocking_section();
-  /* Invoke callbacks now, i.e. outside the blocking section. */
-  ev_invoke_pending(loop);
+  return Val_unit;
+}
+
+/* Invoke callbacks of ready watchers. This must be called after
+   [lwt_libev_loop], outside the blocking section. */
+CAMLprim value lwt_libev_invoke_pending(value val_loop)
+{
+  ev_invoke_pending(Ev_loop_val(val_loop));
   return Val_unit;
 }
 
@@ -141,13 +147,20 @@ static void handle_io(struct ev_loop *loop, ev_io *watcher, int revents)
   caml_callback((value)watcher->data, Val_unit);
 }
 
-static value lwt_libev_io_init(struct ev_loop *loop, int fd, int event, value callback)
+/* Handler of watchers for both directions: the callback receives
+   the readability and writability of the file descriptor. */
+static void handle_io_rw(struct ev_loop *loop, ev_io *watcher, int revents)
+{
+  caml_callback2((value)watcher->data, Val_bool(revents & EV_READ), Val_bool(revents & EV_WRITE));
+}
+
+static value lwt_libev_io_start(struct ev_loop *loop, int fd, int event, void (*handler)(struct ev_loop*, ev_io*, int), value callback)
 {
   CAMLparam1(callback);
   CAMLlocal1(result);
   /* Create and initialise the watcher */
   struct ev_io* watcher = lwt_unix_new(struct ev_io);
-  ev_io_init(watcher, handle_io, fd, event);
+  ev_io_init(watcher, handler, fd, event);
   /* Wrap the watcher into a custom caml value */
   result = caml_alloc_custom(&watcher_ops, sizeof(struct ev_io*), 0, 1);
   Ev_io_val(result) = watcher;
@@ -155,18 +168,43 @@ static value lwt_libev_io_init(struct ev_loop *loop, int fd, int event, value ca
   watcher->data = (void*)callback;
   caml_register_generational_global_root((value*)(&(watcher->data)));
   /* Start the event */
-  ev_io_start(loop, watcher);
+  if (event) ev_io_start(loop, watcher);
   CAMLreturn(result);
 }
 
 CAMLprim value lwt_libev_readable_init(value loop, value fd, value callback)
 {
-  return lwt_libev_io_init(Ev_loop_val(loop), FD_val(fd), EV_READ, callback);
+  return lwt_libev_io_start(Ev_loop_val(loop), FD_val(fd), EV_READ, handle_io, callback);
 }
 
 CAMLprim value lwt_libev_writable_init(value loop, value fd, value callback)
 {
-  return lwt_libev_io_init(Ev_loop_val(loop), FD_val(fd), EV_WRITE, callback);
+  return lwt_libev_io_start(Ev_loop_val(loop), FD_val(fd), EV_WRITE, handle_io, callback);
+}
+
+static int io_events(value readable, value writable)
+{
+  return (Bool_val(readable) ? EV_READ : 0) | (Bool_val(writable) ? EV_WRITE : 0);
+}
+
+CAMLprim value lwt_libev_io_init(value loop, value fd, value readable, value writable, value callback)
+{
+  return lwt_libev_io_start(Ev_loop_val(loop), FD_val(fd), io_events(readable, writable), handle_io_rw, callback);
+}
+
+/* Change the events watched by a watcher. It is stopped while it
+   has no events. */
+CAMLprim value lwt_libev_io_modify(value val_loop, value val_watcher, value readable, value writable)
+{
+  struct ev_loop *loop = Ev_loop_val(val_loop);
+  struct ev_io* watcher = Ev_io_val(val_watcher);
+  int events = io_events(readable, writable);
+  if ((watcher->events & (EV_READ | EV_WRITE)) != events) {
+    ev_io_stop(loop, watcher);
+    ev_io_set(watcher, watcher->fd, events);
+    if (events) ev_io_start(loop, watcher);
+  }
+  return Val_unit;
 }
 
 CAMLprim value lwt_libev_io_stop(value loop, value val_watcher)
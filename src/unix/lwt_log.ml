@@ -247,7 +247,7 @@ type template = string
 
 let location_key = Lwt.new_key ()
 
-let date_string time =
+let format_date time =
   let tm = Unix.localtime time in
   let month_string =
     match tm.Unix.tm_mon with
@@ -267,6 +267,21 @@ let date_string time =
   in
   Printf.sprintf "%s %2d %02d:%02d:%02d" month_string tm.Unix.tm_mday tm.Unix.tm_hour tm.Unix.tm_min tm.Unix.tm_sec
 
+(* The date has a resolution of one second, so the last formatted one
+   is kept to avoid calling [localtime] for every line. *)
+let last_date = ref (-1., "")
+
+let date_string time =
+  let seconds = floor time in
+  let last_seconds, last_string = !last_date in
+  if seconds = last_seconds then
+    last_string
+  else begin
+    let str = format_date seconds in
+    last_date := (seconds, str);
+    str
+  end
+
 let render ~buffer ~template ~section ~level ~message =
   let time = lazy(Unix.gettimeofday ()) in
   let file, line, column =
@@ -24,32 +24,165 @@ open Lwt
 
 let enter_iter_hooks = Lwt_sequence.create ()
 let leave_iter_hooks = Lwt_sequence.create ()
+
+(* +-----------------------------------------------------------------+
+   | Priorities                                                      |
+   +-----------------------------------------------------------------+ *)
+
+type priority = High | Normal | Low
+
+let priority_key = Lwt.new_key ()
+
+let current_priority () =
+  match Lwt.get priority_key with
+    | Some priority -> priority
+    | None -> Normal
+
+let with_priority priority f = Lwt.with_value priority_key (Some priority) f
+
+(* Yielded threads, one sequence per priority. *)
+let yielded_high = Lwt_sequence.create ()
 let yielded = Lwt_sequence.create ()
+let yielded_low = Lwt_sequence.create ()
+
+let low_quota = ref 16
+
+let low_priority_quota () = !low_quota
+
+let set_low_priority_quota n =
+  if n < 1 then invalid_arg "Lwt_main.set_low_priority_quota";
+  low_quota := n
+
+let yield ?priority () =
+  match match priority with Some p -> p | None -> current_priority () with
+    | High -> add_task_r yielded_high
+    | Normal -> add_task_r yielded
+    | Low -> add_task_r yielded_low
+
+let nothing_yielded () =
+  Lwt_sequence.is_empty yielded && Lwt_sequence.is_empty yielded_high && Lwt_sequence.is_empty yielded_low
+
+(* +-----------------------------------------------------------------+
+   | Stalls detection                                                |
+   +-----------------------------------------------------------------+ *)
+
+type stall = {
+  stall_source : string;
+  stall_label : string option;
+  stall_duration : float;
+  stall_time : float;
+}
+
+let stall_hooks = Lwt_sequence.create ()
 
-let yield () = add_task_r yielded
+let threshold = ref 0.
 
-let rec run t =
+(* The last stalls, the most recent first. *)
+let max_recent_stalls = 32
+let recent = ref []
+let recent_count = ref 0
+
+let recent_stalls () = !recent
+
+let report_stall source label duration =
+  let stall = {
+    stall_source = source;
+    stall_label = label;
+    stall_duration = duration;
+    stall_time = Lwt_engine.now ();
+  } in
+  if !recent_count = max_recent_stalls then
+    recent := stall :: List.rev (List.tl (List.rev !recent))
+  else begin
+    recent := stall :: !recent;
+    incr recent_count
+  end;
+  Lwt_sequence.iter_l (fun f -> f stall) stall_hooks
+
+let stall_threshold () = !threshold
+
+let set_stall_threshold t =
+  if t < 0. then invalid_arg "Lwt_main.set_stall_threshold";
+  threshold := t;
+  Lwt_engine.set_callback_monitor t report_stall
+
+(* Run [f] and report it as [source] if it takes too long. *)
+let monitored source f =
+  let start = Lwt_engine.monotonic_time () in
+  f ();
+  let duration = Lwt_engine.monotonic_time () -. start in
+  if duration >= !threshold then report_stall source None duration
+
+(* +-----------------------------------------------------------------+
+   | Main loop                                                       |
+   +-----------------------------------------------------------------+ *)
+
+let wakeup_all seq =
+  if not (Lwt_sequence.is_empty seq) then begin
+    let tmp = Lwt_sequence.create () in
+    Lwt_sequence.transfer_r seq tmp;
+    Lwt_sequence.iter_l (fun wakener -> wakeup wakener ()) tmp
+  end
+
+(* Wakeup at most [!low_quota] low priority threads. Threads yielding
+   again go after the ones that were not woken up. *)
+let wakeup_low () =
+  let rec loop n acc =
+    if n = 0 then
+      acc
+    else
+      match Lwt_sequence.take_opt_l yielded_low with
+        | Some wakener -> loop (n - 1) (wakener :: acc)
+        | None -> acc
+  in
+  List.iter (fun wakener -> wakeup wakener ()) (List.rev (loop !low_quota []))
+
+let wakeup_yielded () =
+  wakeup_all yielded_high;
+  wakeup_all yielded;
+  wakeup_low ()
+
+let iteration () =
+  (* Call enter hooks. *)
+  Lwt_sequence.iter_l (fun f -> f ()) enter_iter_hooks;
+  (* Do the main loop call. *)
+  Lwt_engine.iter (Lwt.paused_count () = 0 && nothing_yielded ());
+  (* Wakeup paused threads again. *)
+  Lwt.wakeup_paused ();
+  (* Wakeup yielded threads now. *)
+  wakeup_yielded ();
+  (* Call leave hooks. *)
+  Lwt_sequence.iter_l (fun f -> f ()) leave_iter_hooks
+
+(* Same as [iteration] but measures the time spent outside the
+   blocking call. Slow engine callbacks are reported by the engine
+   itself. *)
+let monitored_iteration () =
+  let start = Lwt_engine.monotonic_time () in
+  let blocked = (Lwt_engine.stats ()).Lwt_engine.blocked_time in
+  Lwt_sequence.iter_l (fun f -> f ()) enter_iter_hooks;
+  Lwt_engine.iter (Lwt.paused_count () = 0 && nothing_yielded ());
+  monitored "paused threads" Lwt.wakeup_paused;
+  monitored "yielded threads" wakeup_yielded;
+  Lwt_sequence.iter_l (fun f -> f ()) leave_iter_hooks;
+  let blocked = (Lwt_engine.stats ()).Lwt_engine.blocked_time -. blocked in
+  let duration = Lwt_engine.monotonic_time () -. start -. blocked in
+  if duration >= !threshold then report_stall "iteration" None duration
+
+let rec run_loop t =
   (* Wakeup paused threads now. *)
   Lwt.wakeup_paused ();
   match Lwt.poll t with
     | Some x ->
         x
     | None ->
-        (* Call enter hooks. *)
-        Lwt_sequence.iter_l (fun f -> f ()) enter_iter_hooks;
-        (* Do the main loop call. *)
-        Lwt_engine.iter (Lwt.paused_count () = 0 && Lwt_sequence.is_empty yielded);
-        (* Wakeup paused threads again. *)
-        Lwt.wakeup_paused ();
-        (* Wakeup yielded threads now. *)
-        if not (Lwt_sequence.is_empty yielded) then begin
-          let tmp = Lwt_sequence.create () in
-          Lwt_sequence.transfer_r yielded tmp;
-          Lwt_sequence.iter_l (fun wakener -> wakeup wakener ()) tmp
-        end;
-        (* Call leave hooks. *)
-        Lwt_sequence.iter_l (fun f -> f ()) leave_iter_hooks;
-        run t
+        if !threshold > 0. then monitored_iteration () else iteration ();
+        run_loop t
+
+let run t =
+  (* The program may not have run the main loop for a long time. *)
+  Lwt_engine.update_time ();
+  run_loop t
 
 let exit_hooks = Lwt_sequence.create ()
 
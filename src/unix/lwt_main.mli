@@ -24,6 +24,31 @@
 
 (** This module controls the ``main-loop'' of Lwt. *)
 
+(** Priorities of threads resumed by the main loop. *)
+type priority =
+  | High
+      (** Latency critical threads. *)
+  | Normal
+      (** The default. *)
+  | Low
+      (** Background threads. Only a bounded number of them is resumed
+          by each iteration of the main loop. *)
+
+val priority_key : priority Lwt.key
+  (** The priority of the current thread, [Normal] if not set. *)
+
+val with_priority : priority -> (unit -> 'a) -> 'a
+  (** [with_priority priority f] runs [f] with the priority
+      [priority]. Threads created by [f] inherit it. *)
+
+val low_priority_quota : unit -> int
+  (** Returns the maximum number of [Low] priority threads resumed by
+      one iteration of the main loop. *)
+
+val set_low_priority_quota : int -> unit
+  (** Sets the maximum number of [Low] priority threads resumed by one
+      iteration of the main loop. The default is [16]. *)
+
 val run : 'a Lwt.t -> 'a
   (** [run t] calls the Lwt scheduler repeatedly until [t] terminates,
       then returns the value returned by the thread. It [t] fails with
@@ -40,9 +65,15 @@ val run : 'a Lwt.t -> 'a
       registered with [Pervasives.at_exit], use the {!at_exit}
       function of this module instead. *)
 
-val yield : unit -> unit Lwt.t
-  (** [yield ()] is a threads which suspends itself and then resumes
-      as soon as possible and terminates. *)
+val yield : ?priority : priority -> unit -> unit Lwt.t
+  (** [yield ?priority ()] is a threads which suspends itself and then
+      resumes as soon as possible and terminates.
+
+      After each iteration of the main loop, all threads yielded with
+      priority [High] are resumed first, then all the ones with
+      priority [Normal], then at most {!low_priority_quota} ones with
+      priority [Low]. [priority] defaults to the priority of the
+      current thread. *)
 
 val enter_iter_hooks : (unit -> unit) Lwt_sequence.t
   (** Functions that are called before the main iteration. *)
@@ -50,6 +81,44 @@ val enter_iter_hooks : (unit -> unit) Lwt_sequence.t
 val leave_iter_hooks : (unit -> unit) Lwt_sequence.t
   (** Functions that are called after the main iteration. *)
 
+(** {6 Stalls detection} *)
+
+(** When a callback or an iteration of the main loop takes too long,
+    all other threads are blocked. Stall detection measures them and
+    reports those exceeding a threshold. *)
+
+(** A stall. *)
+type stall = {
+  stall_source : string;
+  (** What was running: an engine event such as ["readable fd 5"] or
+      ["timer (1s)"], ["yielded threads"], ["paused threads"] or
+      ["iteration"] for a whole iteration of the main loop. *)
+
+  stall_label : string option;
+  (** The value of {!Lwt_engine.label_key} when the event was
+      registered, if any. *)
+
+  stall_duration : float;
+  (** The time spent, in seconds. *)
+
+  stall_time : float;
+  (** The value of {!Lwt_engine.now} when the stall was detected. *)
+}
+
+val stall_threshold : unit -> float
+  (** Returns the current stall threshold. *)
+
+val set_stall_threshold : float -> unit
+  (** [set_stall_threshold seconds] enables stall detection with the
+      given threshold. [0.] disables it, which is the default. *)
+
+val stall_hooks : (stall -> unit) Lwt_sequence.t
+  (** Functions called each time a stall is detected. They are called
+      synchronously and must not block. *)
+
+val recent_stalls : unit -> stall list
+  (** Returns the last stalls detected, the most recent first. *)
+
 val exit_hooks : (unit -> unit Lwt.t) Lwt_sequence.t
   (** Sets of functions executed just before the program exit.
 
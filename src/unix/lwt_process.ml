@@ -179,8 +179,7 @@ let map_args args =
   end else
     args
 
-let spawn (prog, args) env ?(stdin:redirection=`Keep) ?(stdout:redirection=`Keep) ?(stderr:redirection=`Keep) toclose =
-  let prog = if prog = "" && Array.length args > 0 then args.(0) else prog in
+let fork_exec prog args env stdin stdout stderr toclose =
   match Lwt_unix.fork () with
     | 0 ->
         redirect Unix.stdin stdin;
@@ -201,16 +200,61 @@ let spawn (prog, args) env ?(stdin:redirection=`Keep) ?(stdout:redirection=`Keep
             exit 127
         end
     | id ->
-        let close = function
-          | `FD_move fd ->
-              Unix.close fd
-          | _ ->
-              ()
-        in
-        close stdin;
-        close stdout;
-        close stderr;
-        { id; fd = Unix.stdin }
+        id
+
+#if HAVE_POSIX_SPAWN
+
+(* Redirections, as understood by the C stub. *)
+type spawn_redirection =
+  | Spawn_keep
+  | Spawn_dev_null
+  | Spawn_close
+  | Spawn_copy of Unix.file_descr
+  | Spawn_move of Unix.file_descr
+
+external spawn_process : string -> string array -> string array option -> spawn_redirection array -> Unix.file_descr array -> int = "lwt_process_spawn"
+
+let spawn_redirection = function
+  | `Keep -> Spawn_keep
+  | `Dev_null -> Spawn_dev_null
+  | `Close -> Spawn_close
+  | `FD_copy fd -> Spawn_copy fd
+  | `FD_move fd -> Spawn_move fd
+
+(* posix_spawn avoids copying the page tables of the parent, which
+   is expensive with big heaps. If it fails, for example because the
+   program does not exist, we fall back to fork so the child still
+   exits with code 127 as before. *)
+let create_process prog args env stdin stdout stderr toclose =
+  try
+    spawn_process prog args env
+      (Array.map spawn_redirection [|stdin; stdout; stderr|])
+      (Array.of_list toclose)
+  with Unix.Unix_error _ ->
+    fork_exec prog args env stdin stdout stderr toclose
+
+#else
+
+let create_process = fork_exec
+
+#endif
+
+let spawn (prog, args) env ?(stdin:redirection=`Keep) ?(stdout:redirection=`Keep) ?(stderr:redirection=`Keep) toclose =
+  let prog = if prog = "" && Array.length args > 0 then args.(0) else prog in
+  let id = create_process prog args env stdin stdout stderr toclose in
+  (* Our ends of the pipes must not leak into processes spawned later,
+     otherwise they would never see end of file. *)
+  List.iter Unix.set_close_on_exec toclose;
+  let close = function
+    | `FD_move fd ->
+        Unix.close fd
+    | _ ->
+        ()
+  in
+  close stdin;
+  close stdout;
+  close stderr;
+  { id; fd = Unix.stdin }
 
 let waitproc proc = Lwt_unix.wait4 [] proc.id
 
@@ -395,6 +439,66 @@ let recv_lines pr =
                      end else
                        return x)
 
+(* Pass all the data available in the buffer of [ic] to [f], refilling
+   it first if it is empty. [f] is called with a length of [0] at end
+   of file. Since the buffer is only refilled when it is consumed, the
+   child is blocked as long as the data is not processed. *)
+let next_chunk ic f =
+  Lwt_io.direct_access ic
+    (fun da ->
+       lwt () =
+         if da.Lwt_io.da_ptr < da.Lwt_io.da_max then
+           return ()
+         else
+           lwt _ = da.Lwt_io.da_perform () in
+           return ()
+       in
+       let ptr = da.Lwt_io.da_ptr and len = da.Lwt_io.da_max - da.Lwt_io.da_ptr in
+       da.Lwt_io.da_ptr <- da.Lwt_io.da_max;
+       f da.Lwt_io.da_buffer ptr len)
+
+let recv_chunks pr =
+  let ic = pr#stdout in
+  Gc.finalise ingore_close ic;
+  Lwt_stream.from (fun _ ->
+                     lwt x =
+                       next_chunk ic
+                         (fun buf ptr len ->
+                            if len = 0 then
+                              return None
+                            else begin
+                              let chunk = Lwt_bytes.create len in
+                              Lwt_bytes.unsafe_blit buf ptr chunk 0 len;
+                              return (Some chunk)
+                            end)
+                     in
+                     if x = None then begin
+                       lwt () = Lwt_io.close ic in
+                       return x
+                     end else
+                       return x)
+
+let recv_fold pr f acc =
+  let ic = pr#stdout in
+  let rec loop acc =
+    lwt result =
+      next_chunk ic
+        (fun buf ptr len ->
+           if len = 0 then
+             return (`Done acc)
+           else
+             lwt acc = f buf ptr len acc in
+             return (`Continue acc))
+    in
+    match result with
+      | `Done acc -> return acc
+      | `Continue acc -> loop acc
+  in
+  try_lwt
+    loop acc
+  finally
+    Lwt_io.close ic
+
 let recv pr =
   let ic = pr#stdout in
   try_lwt
@@ -430,6 +534,12 @@ let pread_line ?timeout ?env ?stdin ?stderr cmd =
 let pread_lines ?timeout ?env ?stdin ?stderr cmd =
   recv_lines (open_process_in ?timeout ?env ?stdin ?stderr cmd)
 
+let pread_chunks ?timeout ?env ?stdin ?stderr cmd =
+  recv_chunks (open_process_in ?timeout ?env ?stdin ?stderr cmd)
+
+let pfold ?timeout ?env ?stdin ?stderr cmd f acc =
+  recv_fold (open_process_in ?timeout ?env ?stdin ?stderr cmd) f acc
+
 (* Sending *)
 
 let pwrite ?timeout ?env ?stdout ?stderr cmd text =
@@ -522,3 +632,336 @@ let pmap_lines ?timeout ?env ?stderr cmd lines =
   let pr = open_process ?timeout ?env ?stderr cmd in
   let sender = send Lwt_io.write_lines pr lines in
   monitor sender (recv_lines pr)
+
+(* +-----------------------------------------------------------------+
+   | Pipelines                                                       |
+   +-----------------------------------------------------------------+ *)
+
+type stage =
+  [ `Command of command
+  | `Map_lines of string Lwt_stream.t -> string Lwt_stream.t ]
+
+(* Pipes created by [pipeline] are close-on-exec in the parent, so
+   they do not leak into other stages. *)
+let cloexec_pipe () =
+  let fd_r, fd_w = Unix.pipe () in
+  Unix.set_close_on_exec fd_r;
+  Unix.set_close_on_exec fd_w;
+  (fd_r, fd_w)
+
+(* Returns a file descriptor for the given redirection of [fd], and
+   whether it must be closed after use. *)
+let redirection_fd fd mode = function
+  | `Keep -> Some (fd, false)
+  | `Dev_null -> Some (Unix.openfile "/dev/null" [mode] 0o666, true)
+  | `Close -> None
+  | `FD_copy fd' -> Some (fd', false)
+  | `FD_move fd' -> Some (fd', true)
+
+(* File descriptors we do not own are shared with the rest of the
+   program, so their flags must not be changed. *)
+let channel_of_fd mode = function
+  | None ->
+      None
+  | Some (fd, true) ->
+      let fd = Lwt_unix.of_unix_file_descr fd in
+      Some (Lwt_io.of_fd ~mode fd)
+  | Some (fd, false) ->
+      let fd = Lwt_unix.of_unix_file_descr ~blocking:true ~set_flags:false fd in
+      Some (Lwt_io.of_fd ~mode ~close:return fd)
+
+let close_redirection = function
+  | `FD_move fd -> (try Unix.close fd with Unix.Unix_error _ -> ())
+  | _ -> ()
+
+let close_channel = function
+  | Some ch -> Lwt_io.close ch
+  | None -> return ()
+
+(* Run a transformation in the parent. *)
+let map_lines f input output =
+  let ic = channel_of_fd Lwt_io.input input
+  and oc = channel_of_fd Lwt_io.output output in
+  let get default = function
+    | Some ch -> ch
+    | None -> default
+  in
+  try_lwt
+    Lwt_io.write_lines (get Lwt_io.null oc) (f (Lwt_io.read_lines (get Lwt_io.zero ic)))
+  finally
+    close_channel ic <&> close_channel oc
+
+(* Forward the output of the last stage to [sink]. *)
+let forward fd sink =
+  let source = Lwt_unix.of_unix_file_descr fd in
+  let rec loop () =
+    match_lwt Lwt_unix.splice source sink 65536 with
+      | 0 -> return ()
+      | _ -> loop ()
+  in
+  try_lwt
+    loop ()
+  finally
+    Lwt_unix.close source
+
+let pipeline ?env ?(stdin:redirection=`Keep) ?(stdout:redirection option) ?(stderr:redirection option) ?sink stages =
+  if stages == [] then invalid_arg "Lwt_process.pipeline";
+  let stdout, forwarder =
+    match stdout, sink with
+      | Some _, Some _ ->
+          invalid_arg "Lwt_process.pipeline: stdout and sink are exclusive"
+      | Some stdout, None ->
+          (stdout, [])
+      | None, None ->
+          (`Keep, [])
+      | None, Some sink ->
+          let fd_r, fd_w = cloexec_pipe () in
+          (`FD_move fd_w, [forward fd_r sink])
+  in
+  (* [stderr] is shared by all commands, so a moved descriptor is
+     copied into each of them and closed once they are all
+     started. *)
+  let stderr, close_stderr =
+    match stderr with
+      | Some (`FD_move fd) ->
+          (Some (`FD_copy fd : redirection), (fun () -> Unix.close fd))
+      | _ ->
+          (stderr, ignore)
+  in
+  (* Stop the stages already started when a later one can not be. *)
+  let abort procs threads =
+    List.iter
+      (fun (proc, _) ->
+         (* The process is reaped by the thread waiting for it. *)
+         try terminate proc with Unix.Unix_error _ -> ())
+      procs;
+    List.iter cancel threads
+  in
+  (* [input] is the redirection for the standard input of the next
+     stage. Commands are connected directly by pipes, so data flows
+     between them without going through this process. *)
+  let rec start input procs threads = function
+    | [] ->
+        (List.rev_map snd procs, threads)
+    | stage :: rest ->
+        let started, next =
+          try
+            let output, next =
+              if rest == [] then
+                (stdout, `Keep)
+              else
+                let fd_r, fd_w = cloexec_pipe () in
+                (`FD_move fd_w, `FD_move fd_r)
+            in
+            try
+              match stage with
+                | `Command cmd ->
+                    (`Proc (spawn cmd env ~stdin:input ~stdout:output ?stderr []), next)
+                | `Map_lines f ->
+                    let input = redirection_fd Unix.stdin Unix.O_RDONLY input
+                    and output = redirection_fd Unix.stdout Unix.O_WRONLY output in
+                    (`Thread (map_lines f input output), next)
+            with exn ->
+              close_redirection output;
+              close_redirection next;
+              raise exn
+          with exn ->
+            (* Descriptors moved to the pipeline and not consumed yet
+               would otherwise leak. *)
+            close_redirection input;
+            if rest != [] then close_redirection stdout;
+            abort procs threads;
+            raise exn
+        in
+        match started with
+          | `Proc proc ->
+              start next ((proc, waitproc proc) :: procs) threads rest
+          | `Thread thread ->
+              start next procs (thread :: threads) rest
+  in
+  let procs, threads =
+    try
+      start stdin [] forwarder stages
+    with exn ->
+      close_stderr ();
+      raise exn
+  in
+  close_stderr ();
+  lwt () = join threads in
+  Lwt_list.map_s (fun proc -> proc >|= status) procs
+
+(* +-----------------------------------------------------------------+
+   | Worker pools                                                    |
+   +-----------------------------------------------------------------+ *)
+
+exception Worker_queue_full
+exception Worker_crashed of Unix.process_status
+exception Worker_failed of string
+exception Worker_pool_closed
+
+(* Name of the environment variable telling a program it has been
+   started as a worker. *)
+let worker_variable = "LWT_PROCESS_WORKER"
+
+let worker_main () =
+  match try Some (Sys.getenv worker_variable) with Not_found -> None with
+    | None ->
+        ()
+    | Some _ ->
+        (* Replies go to a private copy of stdout, so tasks printing
+           on stdout do not corrupt the protocol. *)
+        let replies = Unix.out_channel_of_descr (Unix.dup Unix.stdout) in
+        Unix.dup2 Unix.stderr Unix.stdout;
+        set_binary_mode_in stdin true;
+        let rec loop () =
+          match try Some (Marshal.from_channel stdin : unit -> Obj.t) with End_of_file -> None with
+            | None ->
+                exit 0
+            | Some f ->
+                let reply = try `Ok (f ()) with exn -> `Error (Printexc.to_string exn) in
+                Marshal.to_channel replies reply [Marshal.Closures];
+                flush replies;
+                loop ()
+        in
+        loop ()
+
+type worker = {
+  worker_process : process;
+  mutable healthy : bool;
+  (* Whether requests and replies are still in sync. A worker is
+     thrown away as soon as this is no longer the case. *)
+  mutable busy : bool;
+  (* Whether the worker is running a task. *)
+  released : unit Lwt_condition.t;
+  (* Signaled when the worker is done with its task. *)
+}
+
+type worker_pool = {
+  pool : worker Lwt_pool.t;
+  max_queued : int;
+  mutable queued : int;
+  (* Number of tasks waiting for a free worker. *)
+  workers : worker list ref;
+  (* All live workers, to close them. *)
+  closed : bool ref;
+  (* Shared with the pool, so no worker is started once the pool is
+     closed. *)
+}
+
+let spawn_worker workers closed () =
+  if !closed then
+    raise_lwt Worker_pool_closed
+  else begin
+    let env = Array.append [|worker_variable ^ "=1"|] (Unix.environment ()) in
+    let worker = {
+      worker_process = new process ~env (Sys.executable_name, Sys.argv);
+      healthy = true;
+      busy = false;
+      released = Lwt_condition.create ();
+    } in
+    workers := worker :: !workers;
+    return worker
+  end
+
+let discard_worker wp worker =
+  worker.healthy <- false;
+  wp.workers := List.filter ((!=) worker) !(wp.workers)
+
+let create_worker_pool ?(max_queued = max_int) count =
+  let workers = ref [] and closed = ref false in
+  {
+    pool =
+      Lwt_pool.create count
+        ~check:(fun worker ok -> ok worker.healthy)
+        ~validate:(fun worker ->
+                     if worker.healthy && worker.worker_process#state = Running then
+                       return true
+                     else begin
+                       (* The worker died while idle. The pool drops it,
+                          so release it here. *)
+                       worker.healthy <- false;
+                       workers := List.filter ((!=) worker) !workers;
+                       lwt _ = worker.worker_process#close in
+                       return false
+                     end)
+        (spawn_worker workers closed);
+    max_queued;
+    queued = 0;
+    workers;
+    closed;
+  }
+
+let run_task wp worker f =
+  let proc = worker.worker_process in
+  lwt reply =
+    try_lwt
+      lwt () = Lwt_io.write_value proc#stdin ~flags:[Marshal.Closures] f in
+      lwt () = Lwt_io.flush proc#stdin in
+      Lwt_io.read_value proc#stdout
+    with
+      | Unix.Unix_error (Unix.EPIPE, _, _) | End_of_file ->
+          (* The worker died, it will be replaced by the pool. *)
+          discard_worker wp worker;
+          lwt status = proc#close in
+          raise_lwt (Worker_crashed status)
+      | exn ->
+          (* The reply may still come, so this worker can not be
+             reused. *)
+          discard_worker wp worker;
+          proc#terminate;
+          ignore (proc#close);
+          raise_lwt exn
+  in
+  match reply with
+    | `Ok x -> return x
+    | `Error msg -> raise_lwt (Worker_failed msg)
+
+let run_in_worker wp f =
+  if !(wp.closed) then
+    raise_lwt Worker_pool_closed
+  else if wp.queued >= wp.max_queued then
+    raise_lwt Worker_queue_full
+  else begin
+    wp.queued <- wp.queued + 1;
+    let waiting = ref true in
+    let started () =
+      if !waiting then begin
+        waiting := false;
+        wp.queued <- wp.queued - 1
+      end
+    in
+    try_lwt
+      Lwt_pool.use wp.pool
+        (fun worker ->
+           started ();
+           (* Tasks queued when the pool was closed are given the
+              workers released afterwards. *)
+           if !(wp.closed) then
+             raise_lwt Worker_pool_closed
+           else begin
+             worker.busy <- true;
+             try_lwt
+               run_task wp worker f
+             finally
+               worker.busy <- false;
+               Lwt_condition.broadcast worker.released ();
+               return ()
+           end)
+    finally
+      started ();
+      return ()
+  end
+
+let close_worker_pool wp =
+  wp.closed := true;
+  let workers = !(wp.workers) in
+  wp.workers := [];
+  Lwt_list.iter_p
+    (fun worker ->
+       (* Let the running task finish first. *)
+       lwt () = if worker.busy then Lwt_condition.wait worker.released else return () in
+       worker.healthy <- false;
+       (* Workers exit when their standard input is closed. *)
+       lwt _ = worker.worker_process#close in
+       return ())
+    workers
@@ -123,6 +123,30 @@ val pread_lines :
   ?stderr : redirection ->
   command -> string Lwt_stream.t
 
+val pread_chunks :
+  ?timeout : float ->
+  ?env : string array ->
+  ?stdin : redirection ->
+  ?stderr : redirection ->
+  command -> Lwt_bytes.t Lwt_stream.t
+  (** Returns the output of the command as a stream of chunks, of at
+      most {!Lwt_io.default_buffer_size} bytes each. The output is
+      read only as the stream is consumed, so the command is blocked
+      when the reader is too slow and memory usage stays bounded. *)
+
+val pfold :
+  ?timeout : float ->
+  ?env : string array ->
+  ?stdin : redirection ->
+  ?stderr : redirection ->
+  command -> (Lwt_bytes.t -> int -> int -> 'a -> 'a Lwt.t) -> 'a -> 'a Lwt.t
+  (** [pfold cmd f init] folds [f] over the output of [cmd]. [f buf
+      ofs len acc] receives the [len] bytes of [buf] starting at
+      [ofs]. [buf] is the buffer of the channel, so it is only valid
+      until the thread returned by [f] terminates. Nothing is
+      allocated for the data, and the command is blocked until [f]
+      is done. *)
+
 (** {8 Sending} *)
 
 val pwrite :
@@ -327,3 +351,102 @@ val with_process_full :
   ?timeout : float ->
   ?env : string array ->
   command -> (process_full -> 'a Lwt.t) -> 'a Lwt.t
+
+(** {6 Pipelines} *)
+
+(** A stage of a pipeline. *)
+type stage =
+    [ `Command of command
+        (** A process. *)
+    | `Map_lines of string Lwt_stream.t -> string Lwt_stream.t
+        (** A transformation of lines done by the current process. *) ]
+
+val pipeline :
+  ?env : string array ->
+  ?stdin : redirection ->
+  ?stdout : redirection ->
+  ?stderr : redirection ->
+  ?sink : Lwt_unix.file_descr ->
+  stage list -> Unix.process_status list Lwt.t
+  (** [pipeline stages] runs [stages], connecting the standard output
+      of each stage to the standard input of the next one, like a
+      shell pipeline. It returns the exit statuses of all commands
+      once all stages have terminated.
+
+      Consecutive commands are connected directly by a pipe, so their
+      data never goes through the current process. Data is only read
+      by the current process for [`Map_lines] stages.
+
+      [stdin] is the redirection for the first stage and [stdout] the
+      one for the last stage. A file or a blocking socket can be given
+      with [`FD_copy] or [`FD_move]. [stderr] is the redirection for
+      the standard error of all commands; with [`FD_move] the
+      descriptor is closed once all commands are started.
+
+      If a stage cannot be started, the stages already started are
+      stopped, descriptors given with [`FD_move] are closed and the
+      exception is raised.
+
+      @param sink a file descriptor the output of the last stage is
+      forwarded to, instead of [stdout], so [stdout] and [sink] cannot
+      be given at the same time. It is done with
+      {!Lwt_unix.splice}, so the data does not go through user space
+      on Linux. This is useful for non-blocking sockets, which cannot
+      be handed to child processes. *)
+
+(** {6 Worker processes} *)
+
+(** A worker pool runs functions in child processes, so CPU-bound
+    work can use all cores. Workers are the current program started
+    again, with the same arguments, so {!worker_main} must be the
+    very first thing the program does. Tasks are closures marshaled with
+    [Marshal.Closures], so they must not capture values that cannot
+    be marshaled, such as channels or threads. *)
+
+type worker_pool
+  (** Type of pools of worker processes. *)
+
+exception Worker_queue_full
+  (** Exception raised by {!run_in_worker} when too many tasks are
+      waiting for a free worker. *)
+
+exception Worker_crashed of Unix.process_status
+  (** Exception raised by {!run_in_worker} when the worker running
+      the task exited. It is replaced by a new one for the next
+      tasks. *)
+
+exception Worker_failed of string
+  (** Exception raised by {!run_in_worker} when the task raised an
+      exception in the worker. The argument is the result of
+      [Printexc.to_string] on this exception. *)
+
+exception Worker_pool_closed
+  (** Exception raised by {!run_in_worker} when the pool is
+      closed. *)
+
+val worker_main : unit -> unit
+  (** If the program has been started as a worker, [worker_main ()]
+      runs tasks until the pool is closed and then exits. Otherwise
+      it returns immediately.
+
+      Since workers are started with the same [Sys.argv] as the
+      program, it must be the very first thing the program does,
+      before parsing its arguments or having any side effect. *)
+
+val create_worker_pool : ?max_queued : int -> int -> worker_pool
+  (** [create_worker_pool ?max_queued count] creates a pool of at
+      most [count] workers. Workers are started on demand.
+
+      @param max_queued the maximum number of tasks waiting for a
+      free worker, unlimited by default. *)
+
+val run_in_worker : worker_pool -> (unit -> 'a) -> 'a Lwt.t
+  (** [run_in_worker pool f] runs [f ()] in a worker of [pool] and
+      returns its result. If the thread is canceled while the task
+      is running, the worker is killed. *)
+
+val close_worker_pool : worker_pool -> unit Lwt.t
+  (** [close_worker_pool pool] stops all the workers of [pool] and
+      waits for their termination. Tasks already running are
+      completed first, while tasks still waiting for a worker and
+      new ones fail with {!Worker_pool_closed}. *)
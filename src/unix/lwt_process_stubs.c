@@ -119,4 +119,122 @@ CAMLprim value lwt_process_terminate_process(value handle, value code)
   return Val_unit;
 }
 
+#else /* defined(LWT_ON_WINDOWS) */
+
+#if defined(HAVE_POSIX_SPAWN)
+
+#include <spawn.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <stdlib.h>
+
+#include <lwt_unix.h>
+
+#include <caml/memory.h>
+#include <caml/alloc.h>
+#include <caml/fail.h>
+#include <caml/signals.h>
+
+extern char **environ;
+
+/* Constant constructors of [Lwt_process.spawn_redirection]. */
+#define SPAWN_KEEP 0
+#define SPAWN_DEV_NULL 1
+#define SPAWN_CLOSE 2
+
+/* Non-constant constructors of [Lwt_process.spawn_redirection]. */
+#define SPAWN_COPY 0
+#define SPAWN_MOVE 1
+
+static char **copy_strings(value array)
+{
+  mlsize_t i, length = Wosize_val(array);
+  char **result = lwt_unix_malloc((length + 1) * sizeof(char*));
+  for (i = 0; i < length; i++)
+    result[i] = lwt_unix_strdup(String_val(Field(array, i)));
+  result[length] = NULL;
+  return result;
+}
+
+static void free_strings(char **strings)
+{
+  char **p;
+  for (p = strings; *p != NULL; p++) free(*p);
+  free(strings);
+}
+
+/* Add the file actions implementing [redirection] for [fd], in the
+   same order as [Lwt_process.redirect] does after a fork. */
+static int add_redirection(posix_spawn_file_actions_t *actions, int fd, value redirection)
+{
+  int ret, fd2;
+  if (Is_long(redirection)) {
+    switch (Int_val(redirection)) {
+    case SPAWN_DEV_NULL:
+      return posix_spawn_file_actions_addopen(actions, fd, "/dev/null", O_RDWR, 0666);
+    case SPAWN_CLOSE:
+      return posix_spawn_file_actions_addclose(actions, fd);
+    default:
+      return 0;
+    }
+  }
+  fd2 = FD_val(Field(redirection, 0));
+  ret = posix_spawn_file_actions_adddup2(actions, fd2, fd);
+  if (ret == 0 && Tag_val(redirection) == SPAWN_MOVE && fd2 != fd)
+    ret = posix_spawn_file_actions_addclose(actions, fd2);
+  return ret;
+}
+
+/* Spawn a process without copying the address space of the parent:
+   glibc implements posix_spawn with clone(CLONE_VM | CLONE_VFORK),
+   and reports exec failures as errors. */
+CAMLprim value lwt_process_spawn(value val_prog, value val_args, value val_env, value val_redirections, value val_toclose)
+{
+  CAMLparam5(val_prog, val_args, val_env, val_redirections, val_toclose);
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  pid_t pid;
+  char *prog;
+  char **argv, **envp;
+  int fd, ret;
+  mlsize_t i;
+
+  posix_spawn_file_actions_init(&actions);
+  ret = 0;
+  for (fd = 0; fd < 3 && ret == 0; fd++)
+    ret = add_redirection(&actions, fd, Field(val_redirections, fd));
+  for (i = 0; i < Wosize_val(val_toclose) && ret == 0; i++)
+    ret = posix_spawn_file_actions_addclose(&actions, FD_val(Field(val_toclose, i)));
+  if (ret != 0) {
+    posix_spawn_file_actions_destroy(&actions);
+    unix_error(ret, "posix_spawn_file_actions", Nothing);
+  }
+
+  /* Signals blocked by lwt must not stay blocked in the child. */
+  posix_spawnattr_init(&attr);
+  lwt_unix_child_sigmask(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+  prog = lwt_unix_strdup(String_val(val_prog));
+  argv = copy_strings(val_args);
+  envp = Is_block(val_env) ? copy_strings(Field(val_env, 0)) : environ;
+
+  caml_enter_blocking_section();
+  ret = posix_spawnp(&pid, prog, &actions, &attr, argv, envp);
+  caml_leave_blocking_section();
+
+  free(prog);
+  free_strings(argv);
+  if (Is_block(val_env)) free_strings(envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (ret != 0) unix_error(ret, "posix_spawnp", Nothing);
+  CAMLreturn(Val_int(pid));
+}
+
+#endif /* defined(HAVE_POSIX_SPAWN) */
+
 #endif /* defined(LWT_ON_WINDOWS) */
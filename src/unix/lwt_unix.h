@@ -57,6 +57,16 @@ char *lwt_unix_strdup(char *string);
 /* Raise [Lwt_unix.Not_available]. */
 void lwt_unix_not_available(char const *feature) Noreturn;
 
+#if !defined(LWT_ON_WINDOWS)
+
+#include <signal.h>
+
+/* Store in [mask] the signal mask a child process must start with:
+   the current one, minus the signals lwt blocks for its own use. */
+void lwt_unix_child_sigmask(sigset_t *mask);
+
+#endif
+
 /* +-----------------------------------------------------------------+
    | Notifications                                                   |
    +-----------------------------------------------------------------+ */
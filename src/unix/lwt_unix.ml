@@ -124,33 +124,149 @@ let call_notification id =
     | None ->
         ()
 
+(* +-----------------------------------------------------------------+
+   | Deadlines                                                       |
+   +-----------------------------------------------------------------+ *)
+
+exception Timeout
+
+(* Operations blocked in a thread with a deadline are not given a
+   timer each. They are put in buckets of [deadline_resolution]
+   seconds, and a single repeated timer, running only while there
+   are buckets, expires them. *)
+
+let deadline_key : float Lwt.key = Lwt.new_key ()
+
+let deadline () = Lwt.get deadline_key
+
+let with_deadline d f =
+  (* As for timers, the time may be stale outside of callbacks of
+     events, and the deadline would be reached too early. *)
+  Lwt_engine.refresh_time ();
+  let deadline = Lwt_engine.now () +. d in
+  let deadline =
+    match Lwt.get deadline_key with
+      | Some deadline' when deadline' < deadline -> deadline'
+      | _ -> deadline
+  in
+  Lwt.with_value deadline_key (Some deadline) f
+
+let deadline_resolution = 0.05
+
+let deadline_buckets : (int, (unit -> unit) Lwt_sequence.t) Hashtbl.t = Hashtbl.create 16
+
+(* The last bucket expired. *)
+let deadline_checked = ref 0
+
+let deadline_timer = ref Lwt_engine.fake_event
+
+(* Stop the timer if there is no more buckets. *)
+let check_deadline_timer () =
+  if Hashtbl.length deadline_buckets = 0 then begin
+    Lwt_engine.stop_event !deadline_timer;
+    deadline_timer := Lwt_engine.fake_event
+  end
+
+let expire_bucket id =
+  match try Some(Hashtbl.find deadline_buckets id) with Not_found -> None with
+    | Some actions ->
+        Hashtbl.remove deadline_buckets id;
+        Lwt_sequence.iter_node_l (fun node -> Lwt_sequence.remove node; Lwt_sequence.get node ()) actions
+    | None ->
+        ()
+
+let expire_deadlines _ =
+  let current = int_of_float (floor (Lwt_engine.now () /. deadline_resolution)) in
+  if current - !deadline_checked <= Hashtbl.length deadline_buckets then
+    for id = !deadline_checked + 1 to current do
+      expire_bucket id
+    done
+  else begin
+    (* After a jump of the clock, it is cheaper to look only at
+       existing buckets. *)
+    let ids = Hashtbl.fold (fun id actions acc -> if id <= current then id :: acc else acc) deadline_buckets [] in
+    List.iter expire_bucket (List.sort compare ids)
+  end;
+  deadline_checked := current;
+  check_deadline_timer ()
+
+(* [add_deadline deadline f] calls [f] when [deadline] is reached,
+   unless the returned function is called before. *)
+let add_deadline deadline f =
+  if !deadline_timer == Lwt_engine.fake_event then begin
+    deadline_checked := int_of_float (floor (Lwt_engine.now () /. deadline_resolution));
+    deadline_timer := Lwt_engine.on_timer deadline_resolution true expire_deadlines
+  end;
+  let id = int_of_float (ceil (deadline /. deadline_resolution)) in
+  let actions =
+    try
+      Hashtbl.find deadline_buckets id
+    with Not_found ->
+      let actions = Lwt_sequence.create () in
+      Hashtbl.add deadline_buckets id actions;
+      actions
+  in
+  let node = Lwt_sequence.add_r f actions in
+  fun () ->
+    Lwt_sequence.remove node;
+    (* Remove the bucket if it is now empty, so the timer does not
+       keep running for nothing. *)
+    if Lwt_sequence.is_empty actions
+      && (try Hashtbl.find deadline_buckets id == actions with Not_found -> false) then begin
+      Hashtbl.remove deadline_buckets id;
+      check_deadline_timer ()
+    end
+
+(* Makes [waiter] fail with [Timeout] if the deadline of the current
+   thread, if any, is reached before it terminates. [stop] must
+   unregister what [waiter] is waiting for. *)
+let guard_deadline waiter wakener stop =
+  match Lwt.get deadline_key with
+    | None ->
+        ()
+    | Some deadline ->
+        let remove = add_deadline deadline (fun () -> stop (); Lwt.wakeup_exn wakener Timeout) in
+        Lwt.on_termination waiter remove
+
+let deadline_passed () =
+  match Lwt.get deadline_key with
+    | Some deadline -> deadline <= Lwt_engine.now ()
+    | None -> false
+
 (* +-----------------------------------------------------------------+
    | Sleepers                                                        |
    +-----------------------------------------------------------------+ *)
 
-let sleep delay =
-  let waiter, wakener = Lwt.task () in
-  let ev = Lwt_engine.on_timer delay false (fun ev -> Lwt_engine.stop_event ev; Lwt.wakeup wakener ()) in
-  Lwt.on_cancel waiter (fun () -> Lwt_engine.stop_event ev);
-  waiter
+let sleep ?slack delay =
+  if deadline_passed () then
+    Lwt.fail Timeout
+  else begin
+    let waiter, wakener = Lwt.task () in
+    let ev = Lwt_engine.on_timer ?slack delay false (fun ev -> Lwt_engine.stop_event ev; Lwt.wakeup wakener ()) in
+    Lwt.on_cancel waiter (fun () -> Lwt_engine.stop_event ev);
+    guard_deadline waiter wakener (fun () -> Lwt_engine.stop_event ev);
+    waiter
+  end
+
+let yield () = Lwt_main.yield ()
 
-let yield = Lwt_main.yield
+let now = Lwt_engine.now
 
+(* The cached time does not advance until the thread yields, so the
+   clock must be read here. *)
 let auto_yield timeout =
-  let limit = ref (Unix.gettimeofday () +. timeout) in
+  let limit = ref (Lwt_engine.monotonic_time () +. timeout) in
   fun () ->
-    let current = Unix.gettimeofday () in
+    let current = Lwt_engine.monotonic_time () in
     if current >= !limit then begin
       limit := current +. timeout;
       yield ();
     end else
       return ()
 
-exception Timeout
-
-let timeout d = sleep d >> Lwt.fail Timeout
+let timeout ?slack d = sleep ?slack d >> Lwt.fail Timeout
 
-let with_timeout d f = Lwt.pick [timeout d; Lwt.apply f ()]
+let with_timeout ?slack d f = Lwt.pick [timeout ?slack d; Lwt.apply f ()]
 
 (* +-----------------------------------------------------------------+
    | Jobs                                                            |
@@ -270,19 +386,79 @@ type file_descr = {
   mutable blocking : bool Lwt.t Lazy.t;
   (* Is the file descriptor in blocking or non-blocking mode *)
 
-  mutable event_readable : Lwt_engine.event option;
-  (* The event used to check the file descriptor for readability. *)
-
-  mutable event_writable : Lwt_engine.event option;
-  (* The event used to check the file descriptor for writability. *)
+  mutable io : io;
+  (* Events and hooks of the file descriptor. This is [no_io] until
+     an action blocks on it for the first time. *)
+}
 
-  hooks_readable : (unit -> unit) Lwt_sequence.t;
-  (* Hooks to call when the file descriptor becomes readable. *)
+(* Most file descriptors never block, or only block on one side, so
+   what is needed to wait for them is allocated lazily. *)
+and io = {
+  mutable event : Lwt_engine.event;
+  (* The event used to check the file descriptor for readability and
+     writability, or [Lwt_engine.fake_event]. *)
+
+  mutable reading : bool;
+  mutable writing : bool;
+  (* Directions watched by [event]. *)
+
+  mutable hooks_readable : (unit -> unit) Lwt_sequence.t;
+  (* Hooks to call when the file descriptor becomes readable, or
+     [no_hooks]. *)
+
+  mutable hooks_writable : (unit -> unit) Lwt_sequence.t;
+  (* Hooks to call when the file descriptor becomes writable, or
+     [no_hooks]. *)
+
+  mutable linger : (int * file_descr) Lwt_sequence.node option;
+  (* If events of the file descriptor are idle, its node in the queue
+     of lingering file descriptors. *)
+
+  mutable watchers_created : int;
+  mutable watchers_reused : int;
+  mutable watchers_spurious : int;
+  (* Statistics about watchers of this file descriptor. *)
+}
 
-  hooks_writable : (unit -> unit) Lwt_sequence.t;
-  (* Hooks to call when the file descriptor becomes writable. *)
+(* Shared sentinels. They are never modified: everything that adds
+   hooks or events goes through [get_io] and [add_hook]. *)
+
+let no_hooks : (unit -> unit) Lwt_sequence.t = Lwt_sequence.create ()
+
+let no_io = {
+  event = Lwt_engine.fake_event;
+  reading = false;
+  writing = false;
+  hooks_readable = no_hooks;
+  hooks_writable = no_hooks;
+  linger = None;
+  watchers_created = 0;
+  watchers_reused = 0;
+  watchers_spurious = 0;
 }
 
+let get_io ch =
+  if ch.io == no_io then
+    ch.io <- {
+      event = Lwt_engine.fake_event;
+      reading = false;
+      writing = false;
+      hooks_readable = no_hooks;
+      hooks_writable = no_hooks;
+      linger = None;
+      watchers_created = 0;
+      watchers_reused = 0;
+      watchers_spurious = 0;
+    };
+  ch.io
+
+(* Blocking states shared by all file descriptors whose mode is
+   known. *)
+let blocking_true = Lazy.lazy_from_val (return true)
+let blocking_false = Lazy.lazy_from_val (return false)
+
+let blocking_of_bool state = if state then blocking_true else blocking_false
+
 #if windows
 
 external is_socket : Unix.file_descr -> bool = "lwt_unix_is_socket" "noalloc"
@@ -291,24 +467,24 @@ let is_blocking ?blocking ?(set_flags=true) fd =
   if is_socket fd then
     match blocking, set_flags with
       | Some state, false ->
-          lazy(return state)
+          blocking_of_bool state
       | Some true, true ->
           Unix.clear_nonblock fd;
-          lazy(return true)
+          blocking_true
       | Some false, true ->
           Unix.set_nonblock fd;
-          lazy(return false)
+          blocking_false
       | None, false ->
-          lazy(return false)
+          blocking_false
       | None, true ->
           Unix.set_nonblock fd;
-          lazy(return false)
+          blocking_false
   else
     match blocking with
       | Some state ->
-          lazy(return state)
+          blocking_of_bool state
       | None ->
-          lazy(return true)
+          blocking_true
 
 #else
 
@@ -320,13 +496,13 @@ let guess_blocking fd =
 let is_blocking ?blocking ?(set_flags=true) fd =
     match blocking, set_flags with
       | Some state, false ->
-          lazy(return state)
+          blocking_of_bool state
       | Some true, true ->
           Unix.clear_nonblock fd;
-          lazy(return true)
+          blocking_true
       | Some false, true ->
           Unix.set_nonblock fd;
-          lazy(return false)
+          blocking_false
       | None, false ->
           lazy(guess_blocking fd)
       | None, true ->
@@ -345,10 +521,7 @@ let mk_ch ?blocking ?(set_flags=true) fd = {
   state = Opened;
   set_flags = set_flags;
   blocking = is_blocking ?blocking ~set_flags fd;
-  event_readable = None;
-  event_writable = None;
-  hooks_readable = Lwt_sequence.create ();
-  hooks_writable = Lwt_sequence.create ();
+  io = no_io;
 }
 
 let rec check_descriptor ch =
@@ -406,25 +579,130 @@ let writable ch =
 let set_state ch st =
   ch.state <- st
 
-let clear_events ch =
-  Lwt_sequence.iter_node_l (fun node -> Lwt_sequence.remove node; Lwt_sequence.get node ()) ch.hooks_readable;
-  Lwt_sequence.iter_node_l (fun node -> Lwt_sequence.remove node; Lwt_sequence.get node ()) ch.hooks_writable;
-  begin
-    match ch.event_readable with
-      | Some ev ->
-          ch.event_readable <- None;
-          Lwt_engine.stop_event ev
-      | None ->
-          ()
+(* +-----------------------------------------------------------------+
+   | Watchers hysteresis                                             |
+   +-----------------------------------------------------------------+ *)
+
+(* Events of a file descriptor are not stopped as soon as there is no
+   more pending actions on it, since it is very common to start a new
+   action on the same file descriptor right after, and stopping then
+   restarting a watcher is not free (with epoll it means two system
+   calls).
+
+   Instead file descriptors with idle events are put in a queue and
+   their events are stopped [!hysteresis] iterations of the main loop
+   later, unless they are used again in the meantime. *)
+
+let hysteresis = ref 1
+
+let event_hysteresis () = !hysteresis
+
+(* File descriptors with idle events, with the iteration after which
+   they must be stopped. Since the hysteresis is the same for all
+   file descriptors, the queue is ordered by deadline. Iterations are
+   counted by [Lwt_engine]. *)
+let lingering = Lwt_sequence.create ()
+
+let set_event_hysteresis n =
+  if n < 0 then invalid_arg "Lwt_unix.set_event_hysteresis";
+  if n < !hysteresis then begin
+    (* Entries added from now on expire before the ones already in
+       the queue, so bring these ones forward to keep the queue
+       ordered. *)
+    let limit = Lwt_engine.iteration_count () + n in
+    Lwt_sequence.iter_node_l
+      (fun node ->
+         let deadline, ch = Lwt_sequence.get node in
+         if deadline > limit then Lwt_sequence.set node (limit, ch))
+      lingering
   end;
-  begin
-    match ch.event_writable with
-      | Some ev ->
-          ch.event_writable <- None;
-          Lwt_engine.stop_event ev
-      | None ->
-          ()
-  end
+  hysteresis := n
+
+(* Called when the watcher of a file descriptor fires. *)
+let rec on_io ch _ readable writable =
+  let io = ch.io in
+  (* If a side fires while nobody is waiting on it, it is stopped
+     immediately, otherwise engines based on level-triggered
+     notifications would busy loop until the end of the hysteresis
+     period. *)
+  let spurious_r = readable && Lwt_sequence.is_empty io.hooks_readable
+  and spurious_w = writable && Lwt_sequence.is_empty io.hooks_writable in
+  if spurious_r || spurious_w then begin
+    io.watchers_spurious <- io.watchers_spurious + 1;
+    set_interest ch (io.reading && not spurious_r) (io.writing && not spurious_w)
+  end;
+  if readable && not spurious_r then Lwt_sequence.iter_l (fun f -> f ()) io.hooks_readable;
+  if writable && not spurious_w then Lwt_sequence.iter_l (fun f -> f ()) io.hooks_writable
+
+(* [set_interest ch readable writable] makes the watcher of [ch]
+   watch the given directions, creating or stopping it as needed. *)
+and set_interest ch readable writable =
+  let io = ch.io in
+  if io.event == Lwt_engine.fake_event then begin
+    if readable || writable then begin
+      io.watchers_created <- io.watchers_created + 1;
+      io.event <- Lwt_engine.on_io ch.fd readable writable (on_io ch)
+    end
+  end else if not (readable || writable) then begin
+    let ev = io.event in
+    io.event <- Lwt_engine.fake_event;
+    Lwt_engine.stop_event ev
+  end else if readable <> io.reading || writable <> io.writing then
+    Lwt_engine.modify_io io.event readable writable;
+  io.reading <- readable;
+  io.writing <- writable
+
+let unlinger io =
+  match io.linger with
+    | Some node ->
+        io.linger <- None;
+        Lwt_sequence.remove node
+    | None ->
+        ()
+
+let rec sweep_lingering () =
+  match Lwt_sequence.take_opt_l lingering with
+    | Some (deadline, ch) when deadline < Lwt_engine.iteration_count () ->
+        let io = ch.io in
+        io.linger <- None;
+        (* Release the hooks and stop watching idle sides. *)
+        let idle_r = Lwt_sequence.is_empty io.hooks_readable
+        and idle_w = Lwt_sequence.is_empty io.hooks_writable in
+        if idle_r then io.hooks_readable <- no_hooks;
+        if idle_w then io.hooks_writable <- no_hooks;
+        set_interest ch (io.reading && not idle_r) (io.writing && not idle_w);
+        sweep_lingering ()
+    | Some ((_, ch) as x) ->
+        (* Not yet expired, put it back. *)
+        ch.io.linger <- Some(Lwt_sequence.add_l x lingering)
+    | None ->
+        ()
+
+let () =
+  ignore
+    (Lwt_sequence.add_r
+       (fun () ->
+          if not (Lwt_sequence.is_empty lingering) then sweep_lingering ())
+       Lwt_main.leave_iter_hooks)
+
+type watcher_stats = {
+  ws_created : int;
+  ws_reused : int;
+  ws_spurious : int;
+}
+
+let watcher_stats ch = {
+  ws_created = ch.io.watchers_created;
+  ws_reused = ch.io.watchers_reused;
+  ws_spurious = ch.io.watchers_spurious;
+}
+
+let clear_events ch =
+  let io = ch.io in
+  Lwt_sequence.iter_node_l (fun node -> Lwt_sequence.remove node; Lwt_sequence.get node ()) io.hooks_readable;
+  Lwt_sequence.iter_node_l (fun node -> Lwt_sequence.remove node; Lwt_sequence.get node ()) io.hooks_writable;
+  unlinger io;
+  set_interest ch false false
 
 let abort ch e =
   if ch.state <> Closed then begin
@@ -455,35 +733,47 @@ type 'a outcome =
   | Exn of exn
   | Requeued of io_event
 
-(* Wait a bit, then stop events that are no more used. *)
+(* Schedule events that are no more used to be stopped. *)
 let stop_events ch =
-  on_success
-    (pause ())
-    (fun () ->
-       if Lwt_sequence.is_empty ch.hooks_readable then begin
-         match ch.event_readable with
-           | Some ev ->
-               ch.event_readable <- None;
-               Lwt_engine.stop_event ev
-           | None ->
-               ()
-       end;
-       if Lwt_sequence.is_empty ch.hooks_writable then begin
-         match ch.event_writable with
-           | Some ev ->
-               ch.event_writable <- None;
-               Lwt_engine.stop_event ev
-           | None ->
-               ()
-       end)
-
-let register_readable ch =
-  if ch.event_readable = None then
-    ch.event_readable <- Some(Lwt_engine.on_readable ch.fd (fun _ -> Lwt_sequence.iter_l (fun f -> f ()) ch.hooks_readable))
-
-let register_writable ch =
-  if ch.event_writable = None then
-    ch.event_writable <- Some(Lwt_engine.on_writable ch.fd (fun _ -> Lwt_sequence.iter_l (fun f -> f ()) ch.hooks_writable))
+  let io = ch.io in
+  if io.linger = None
+    && ((io.reading && Lwt_sequence.is_empty io.hooks_readable)
+        || (io.writing && Lwt_sequence.is_empty io.hooks_writable)) then
+    io.linger <- Some(Lwt_sequence.add_r (Lwt_engine.iteration_count () + !hysteresis, ch) lingering)
+
+(* Called when an event is still active while a new action is
+   registered. The events keep lingering as long as the other
+   direction is watched without hooks. *)
+let reuse_events io =
+  if io.linger <> None then begin
+    io.watchers_reused <- io.watchers_reused + 1;
+    if not ((io.reading && Lwt_sequence.is_empty io.hooks_readable)
+            || (io.writing && Lwt_sequence.is_empty io.hooks_writable)) then
+      unlinger io
+  end
+
+(* [add_hook event ch f] adds [f] to the hooks of [ch] for [event]
+   and makes sure the watcher of [ch] watches the corresponding
+   direction. *)
+let add_hook event ch f =
+  let io = get_io ch in
+  match event with
+    | Read ->
+        if io.hooks_readable == no_hooks then io.hooks_readable <- Lwt_sequence.create ();
+        let node = Lwt_sequence.add_r f io.hooks_readable in
+        if io.reading then
+          reuse_events io
+        else
+          set_interest ch true io.writing;
+        node
+    | Write ->
+        if io.hooks_writable == no_hooks then io.hooks_writable <- Lwt_sequence.create ();
+        let node = Lwt_sequence.add_r f io.hooks_writable in
+        if io.writing then
+          reuse_events io
+        else
+          set_interest ch io.reading true;
+        node
 
 (* Retry a queued syscall, [wakener] is the thread to wakeup if the
    action succeeds: *)
@@ -520,32 +810,22 @@ let rec retry_syscall node event ch wakener action =
         if event <> event' then begin
           Lwt_sequence.remove !node;
           stop_events ch;
-          match event' with
-            | Read ->
-                node := Lwt_sequence.add_r (fun () -> retry_syscall node Read ch wakener action) ch.hooks_readable ;
-                register_readable ch
-            | Write ->
-                node := Lwt_sequence.add_r (fun () -> retry_syscall node Write ch wakener action) ch.hooks_writable;
-                register_writable ch
+          node := add_hook event' ch (fun () -> retry_syscall node event' ch wakener action)
         end
 
 let dummy = Lwt_sequence.add_r ignore (Lwt_sequence.create ())
 
 let register_action event ch action =
-  let waiter, wakener = Lwt.task () in
-  match event with
-    | Read ->
-        let node = ref dummy in
-        node := Lwt_sequence.add_r (fun () -> retry_syscall node Read ch wakener action) ch.hooks_readable;
-        on_cancel waiter (fun () -> Lwt_sequence.remove !node; stop_events ch);
-        register_readable ch;
-        waiter
-    | Write ->
-        let node = ref dummy in
-        node := Lwt_sequence.add_r (fun () -> retry_syscall node Write ch wakener action) ch.hooks_writable;
-        on_cancel waiter (fun () -> Lwt_sequence.remove !node; stop_events ch);
-        register_writable ch;
-        waiter
+  if deadline_passed () then
+    Lwt.fail Timeout
+  else begin
+    let waiter, wakener = Lwt.task () in
+    let node = ref dummy in
+    node := add_hook event ch (fun () -> retry_syscall node event ch wakener action);
+    on_cancel waiter (fun () -> Lwt_sequence.remove !node; stop_events ch);
+    guard_deadline waiter wakener (fun () -> Lwt_sequence.remove !node; stop_events ch);
+    waiter
+  end
 
 (* Wraps a system call *)
 let wrap_syscall event ch action =
@@ -672,6 +952,72 @@ let write ch buf pos len =
       | false ->
           wrap_syscall Write ch (fun () -> stub_write ch.fd buf pos len)
 
+(* Copy through a buffer, when the kernel can not move the data
+   itself. *)
+let copy_data fd_in fd_out len =
+  let buf = String.create (min len 65536) in
+  lwt n = read fd_in buf 0 (String.length buf) in
+  let rec loop ofs =
+    if ofs = n then
+      return n
+    else
+      lwt m = write fd_out buf ofs (n - ofs) in
+      loop (ofs + m)
+  in
+  loop 0
+
+#if HAVE_SPLICE
+
+external stub_splice : Unix.file_descr -> Unix.file_descr -> int -> int = "lwt_unix_splice"
+
+let splice fd_in fd_out len =
+  if len <= 0 then
+    invalid_arg "Lwt_unix.splice"
+  else
+    lwt blocking_in = Lazy.force fd_in.blocking and blocking_out = Lazy.force fd_out.blocking in
+    if blocking_in || blocking_out then
+      copy_data fd_in fd_out len
+    else
+      (* [EAGAIN] does not tell which of the two file descriptors
+         is not ready: unless [fd_in] is a pipe, it may have nothing
+         to read as well as [fd_out] may be full. So we wait for
+         [fd_in] first and, if it still fails once [fd_in] is
+         readable, for [fd_out]. *)
+      let rec loop waited_in =
+        check_descriptor fd_in;
+        check_descriptor fd_out;
+        match
+          try
+            Some(stub_splice fd_in.fd fd_out.fd len)
+          with Unix.Unix_error((Unix.EAGAIN | Unix.EWOULDBLOCK | Unix.EINTR), _, _) ->
+            None
+        with
+          | Some n ->
+              return n
+          | None ->
+              if waited_in then
+                lwt () = wait_write fd_out in
+                loop false
+              else
+                lwt () = wait_read fd_in in
+                loop true
+      in
+      try_lwt
+        loop false
+      with Unix.Unix_error(Unix.EINVAL, _, _) ->
+        (* None of the two file descriptors is a pipe. *)
+        copy_data fd_in fd_out len
+
+#else
+
+let splice fd_in fd_out len =
+  if len <= 0 then
+    invalid_arg "Lwt_unix.splice"
+  else
+    copy_data fd_in fd_out len
+
+#endif
+
 (* +-----------------------------------------------------------------+
    | Seeking and truncating                                          |
    +-----------------------------------------------------------------+ *)
@@ -1074,10 +1420,7 @@ let dup ch =
                    return false)
       else
         ch.blocking;
-    event_readable = None;
-    event_writable = None;
-    hooks_readable = Lwt_sequence.create ();
-    hooks_writable = Lwt_sequence.create ();
+    io = no_io;
   }
 
 let dup2 ch1 ch2 =
@@ -2205,13 +2548,20 @@ let () = init_signals ()
 
 module Signal_map = Map.Make(struct type t = int let compare a b = a - b end)
 
+type signal_info = {
+  si_signal : int;
+  si_pid : int;
+  si_uid : int;
+}
+
 type signal_handler = {
   sh_num : int;
-  sh_node : (signal_handler_id -> int -> unit) Lwt_sequence.node;
+  sh_node : (signal_info -> unit) Lwt_sequence.node;
 }
 
 and signal_handler_id = signal_handler option ref
 
+(* For each monitored signal, its notification and its handlers. *)
 let signals = ref Signal_map.empty
 let signal_count () =
   Signal_map.fold
@@ -2219,33 +2569,113 @@ let signal_count () =
     !signals
     0
 
-let on_signal_full signum handler =
+#if HAVE_SIGNALFD
+
+external signalfd_init : unit -> Unix.file_descr = "lwt_unix_signalfd_init"
+external signalfd_add : int -> unit = "lwt_unix_signalfd_add"
+external signalfd_remove : int -> unit = "lwt_unix_signalfd_remove"
+external signalfd_restore : unit -> unit = "lwt_unix_signalfd_restore"
+external signalfd_read : unit -> signal_info array = "lwt_unix_signalfd_read"
+
+let signalfd_event = ref Lwt_engine.fake_event
+
+let handle_signalfd _ =
+  Array.iter
+    (fun info ->
+       match try Some(Signal_map.find info.si_signal !signals) with Not_found -> None with
+         | Some (_, actions) -> Lwt_sequence.iter_l (fun f -> f info) actions
+         | None -> ())
+    (signalfd_read ())
+
+let signalfd_enabled = ref true
+
+let use_signalfd () = !signalfd_enabled
+let set_use_signalfd x = signalfd_enabled := x
+
+(* Signals received through the signalfd. *)
+let signalfd_signals : (int, unit) Hashtbl.t = Hashtbl.create 16
+
+let install_signal signum actions =
+  (* The signal is blocked only in the current thread. Other threads,
+     for example the ones of Lwt_preemptive, may still receive it, so
+     we keep a regular handler for them. In this case the sender is
+     not known. *)
+  let info = { si_signal = signum; si_pid = 0; si_uid = 0 } in
+  let notification = make_notification (fun () -> Lwt_sequence.iter_l (fun f -> f info) actions) in
+  (try
+     set_signal signum notification;
+     (* SIGCHLD is always monitored by Lwt_unix. Blocking it would
+        also block it in children not started by Lwt, so it keeps the
+        regular handler only. *)
+     if !signalfd_enabled && signum <> Sys.sigchld then begin
+       if !signalfd_event == Lwt_engine.fake_event then
+         signalfd_event := Lwt_engine.on_readable (signalfd_init ()) handle_signalfd;
+       signalfd_add signum;
+       Hashtbl.replace signalfd_signals signum ()
+     end
+   with exn ->
+     remove_signal signum;
+     stop_notification notification;
+     raise exn);
+  notification
+
+let uninstall_signal signum notification =
+  (* Signals still pending are delivered to the handler when
+     unblocked, so remove it last. *)
+  if Hashtbl.mem signalfd_signals signum then begin
+    Hashtbl.remove signalfd_signals signum;
+    signalfd_remove signum
+  end;
+  remove_signal signum;
+  stop_notification notification
+
+let reinstall_signal signum notification =
+  set_signal signum notification;
+  if Hashtbl.mem signalfd_signals signum then signalfd_add signum
+
+#else
+
+let install_signal signum actions =
+  (* The sender is not known. *)
+  let info = { si_signal = signum; si_pid = 0; si_uid = 0 } in
+  let notification = make_notification (fun () -> Lwt_sequence.iter_l (fun f -> f info) actions) in
+  (try
+     set_signal signum notification
+   with exn ->
+     stop_notification notification;
+     raise exn);
+  notification
+
+let uninstall_signal signum notification =
+  remove_signal signum;
+  stop_notification notification
+
+let reinstall_signal signum notification =
+  set_signal signum notification
+
+let use_signalfd () = false
+let set_use_signalfd x = ()
+
+#endif
+
+let on_signal_info signum handler =
   let id = ref None in
   let notification, actions =
     try
       Signal_map.find signum !signals
     with Not_found ->
       let actions = Lwt_sequence.create () in
-      let notification =
-        make_notification
-          (fun () ->
-            Lwt_sequence.iter_l
-              (fun f -> f id signum)
-              actions)
-      in
-      (try
-         set_signal signum notification
-       with exn ->
-         stop_notification notification;
-         raise exn);
+      let notification = install_signal signum actions in
       signals := Signal_map.add signum (notification, actions) !signals;
       (notification, actions)
   in
-  let node = Lwt_sequence.add_r handler actions in
+  let node = Lwt_sequence.add_r (fun info -> handler id info) actions in
   id := Some { sh_num = signum; sh_node = node };
   id
 
-let on_signal signum f = on_signal_full signum (fun id num -> f num)
+let on_signal_full signum handler = on_signal_info signum (fun id info -> handler id info.si_signal)
+
+let on_signal signum f = on_signal_info signum (fun id info -> f info.si_signal)
 
 let disable_signal_handler id =
   match !id with
@@ -2256,15 +2686,14 @@ let disable_signal_handler id =
     Lwt_sequence.remove sh.sh_node;
     let notification, actions = Signal_map.find sh.sh_num !signals in
     if Lwt_sequence.is_empty actions then begin
-      remove_signal sh.sh_num;
       signals := Signal_map.remove sh.sh_num !signals;
-      stop_notification notification
+      uninstall_signal sh.sh_num notification
     end
 
 let reinstall_signal_handler signum =
   match try Some (Signal_map.find signum !signals) with Not_found -> None with
     | Some (notification, actions) ->
-        set_signal signum notification
+        reinstall_signal signum notification
     | None ->
         ()
 
@@ -2279,6 +2708,10 @@ let fork () =
     | 0 ->
         (* Reset threading. *)
         reset_after_fork ();
+#if HAVE_SIGNALFD
+        (* Monitored signals were unblocked for exec. *)
+        signalfd_restore ();
+#endif
         (* Stop the old event for notifications. *)
         Lwt_engine.stop_event !event_notifications;
         (* Reinitialise the notification system. *)
@@ -2324,7 +2757,11 @@ external stub_wait4 : Unix.wait_flag list -> int -> int * Unix.process_status *
 #endif
 
 let wait_children = Lwt_sequence.create ()
-let wait_count () = Lwt_sequence.length wait_children
+
+(* Number of children waited for through a pidfd. *)
+let pidfd_waiters = ref 0
+
+let wait_count () = Lwt_sequence.length wait_children + !pidfd_waiters
 
 #if not windows
 let () =
@@ -2344,6 +2781,58 @@ let () =
              Lwt.wakeup_exn wakener e
          end wait_children)
   end
+
+#if HAVE_PIDFD
+
+external pidfd_open : int -> Unix.file_descr = "lwt_unix_pidfd_open"
+
+(* Wait for the child [pid] through a pidfd: it becomes readable when
+   the child terminates, so its exit only wakes up this waiter instead
+   of rescanning all of [wait_children]. Pidfds do not report stopped
+   children, so [WUNTRACED] and process groups use the generic
+   method. *)
+let wait_pidfd flags pid =
+  if pid <= 0 || List.mem Unix.WUNTRACED flags then
+    None
+  else
+    match try Some (pidfd_open pid) with Unix.Unix_error _ -> None with
+      | None ->
+          None
+      | Some fd ->
+          let (res, w) = Lwt.task () in
+          incr pidfd_waiters;
+          let ev =
+            Lwt_engine.on_readable fd
+              (fun ev ->
+                 Lwt_engine.stop_event ev;
+                 Unix.close fd;
+                 decr pidfd_waiters;
+                 (* Compute the result first, so [w] is woken up
+                    exactly once. *)
+                 let result = try Lwt.make_value (stub_wait4 flags pid) with e -> Lwt.make_error e in
+                 Lwt.wakeup_result w result)
+          in
+          Lwt.on_cancel res (fun () -> Lwt_engine.stop_event ev; Unix.close fd; decr pidfd_waiters);
+          Some res
+
+#else
+
+let wait_pidfd flags pid = None
+
+#endif
+
+(* Wait for a child which has not terminated yet. [flags] must
+   contain [WNOHANG]. *)
+let wait_child flags pid =
+  match wait_pidfd flags pid with
+    | Some res ->
+        res
+    | None ->
+        let (res, w) = Lwt.task () in
+        let node = Lwt_sequence.add_l (w, flags, pid) wait_children in
+        Lwt.on_cancel res (fun _ -> Lwt_sequence.remove node);
+        res
+
 #endif
 
 let _waitpid flags pid =
@@ -2365,10 +2854,7 @@ let waitpid flags pid =
     if pid' <> 0 then
       return res
     else begin
-      let (res, w) = Lwt.task () in
-      let node = Lwt_sequence.add_l (w, flags, pid) wait_children in
-      Lwt.on_cancel res (fun _ -> Lwt_sequence.remove node);
-      lwt (pid, status, _) = res in
+      lwt (pid, status, _) = wait_child flags pid in
       return (pid, status)
     end
 
@@ -2392,12 +2878,8 @@ let wait4 flags pid =
     lwt (pid', _, _) as res = _wait4 flags pid in
     if pid' <> 0 then
       return res
-    else begin
-      let (res, w) = Lwt.task () in
-      let node = Lwt_sequence.add_l (w, flags, pid) wait_children in
-      Lwt.on_cancel res (fun _ -> Lwt_sequence.remove node);
-      res
-    end
+    else
+      wait_child flags pid
 
 #endif
 
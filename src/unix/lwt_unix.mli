@@ -127,9 +127,14 @@ val with_async_switch : (unit -> 'a) -> 'a
 
 (** {6 Sleeping} *)
 
-val sleep : float -> unit Lwt.t
-  (** [sleep d] is a threads which remain suspended for [d] seconds
-      and then terminates. *)
+val sleep : ?slack : float -> float -> unit Lwt.t
+  (** [sleep ?slack d] is a threads which remain suspended for [d]
+      seconds and then terminates.
+
+      [slack] is the number of seconds the thread may be woken up
+      late. Giving one when precision does not matter allows the
+      engine to group timers into fewer wakeups. See
+      {!Lwt_engine.on_timer}. *)
 
 val yield : unit -> unit Lwt.t
   (** [yield ()] is a threads which suspends itself and then resumes
@@ -139,14 +144,19 @@ val auto_yield : float -> (unit -> unit Lwt.t)
   (** [auto_yield timeout] returns a function [f] which will yield
       every [timeout] seconds. *)
 
+val now : unit -> float
+  (** [now ()] returns the monotonic time of the current iteration of
+      the main loop. It is the same as {!Lwt_engine.now}. *)
+
 exception Timeout
   (** Exception raised by timeout operations *)
 
-val timeout : float -> 'a Lwt.t
-  (** [timeout d] is a thread which remains suspended for [d] seconds
-      then fails with {!Timeout} *)
+val timeout : ?slack : float -> float -> 'a Lwt.t
+  (** [timeout ?slack d] is a thread which remains suspended for [d]
+      seconds then fails with {!Timeout}. [slack] is the same as for
+      {!sleep}. *)
 
-val with_timeout : float -> (unit -> 'a Lwt.t) -> 'a Lwt.t
+val with_timeout : ?slack : float -> float -> (unit -> 'a Lwt.t) -> 'a Lwt.t
   (** [with_timeout d f] is a short-hand for:
 
       {[
@@ -154,6 +164,24 @@ val with_timeout : float -> (unit -> 'a Lwt.t) -> 'a Lwt.t
       ]}
   *)
 
+val with_deadline : float -> (unit -> 'a Lwt.t) -> 'a Lwt.t
+  (** [with_deadline d f] runs [f] with a deadline [d] seconds from
+      now. If the current thread already has an earlier deadline, it
+      is kept.
+
+      Every operation of this module that blocks on a file
+      descriptor, as well as {!sleep}, fails with {!Timeout} once the
+      deadline is reached. Contrary to {!with_timeout}, nothing is
+      allocated unless an operation actually blocks, and blocked
+      operations share one coarse timer: they may fail up to 50
+      milliseconds after the deadline.
+
+      Jobs are not interrupted by deadlines. *)
+
+val deadline : unit -> float option
+  (** Returns the deadline of the current thread, as a value of
+      {!now}, if any. *)
+
 (** {6 Operation on file-descriptors} *)
 
 type file_descr
@@ -331,6 +359,14 @@ val write : file_descr -> string -> int -> int -> int Lwt.t
   (** [read fd buf ofs len] has the same semantic as [Unix.write], but
       is cooperative *)
 
+val splice : file_descr -> file_descr -> int -> int Lwt.t
+  (** [splice fd_in fd_out len] moves at most [len] bytes from
+      [fd_in] to [fd_out] and returns the number of bytes moved, [0]
+      meaning end of file. When one of them is a pipe and both are in
+      non-blocking mode, data is moved by the kernel with the Linux
+      [splice] system call without going through user space. Otherwise
+      it is copied through a buffer. *)
+
 val readable : file_descr -> bool
   (** Returns whether the given file descriptor is currently
       readable. *)
@@ -638,6 +674,54 @@ val on_signal_full : int -> (signal_handler_id -> int -> unit) -> signal_handler
       also receive the signal handler identifier as argument so it can
       disable it. *)
 
+(** Information about a received signal. *)
+type signal_info = {
+  si_signal : int;
+  (** The signal number. *)
+
+  si_pid : int;
+  (** The process id of the sender, or [0] if it is not known. *)
+
+  si_uid : int;
+  (** The real user id of the sender, or [0] if it is not known. *)
+}
+
+val on_signal_info : int -> (signal_handler_id -> signal_info -> unit) -> signal_handler_id
+  (** [on_signal_info signum f] is the same as [on_signal_full signum
+      f] except that [f] receives information about the signal.
+
+      On Linux, signals are received through a signalfd: monitored
+      signals are blocked and all pending ones are read at once, so
+      the sender is known, no handler runs asynchronously and
+      blocking system calls are not interrupted. Signals are only
+      blocked in the thread calling [on_signal_info]: threads which
+      do not block them, such as threads created before or by
+      {!Lwt_preemptive}, still receive them through a regular
+      handler. In this case the handlers are still called, but the
+      sender is not known and system calls of these threads may be
+      interrupted. To avoid this, call [on_signal_info] before
+      creating any thread. On other systems the sender is not
+      known.
+
+      The blocked signals are inherited by threads created afterwards
+      and by child processes. They are unblocked in children created
+      with {!fork} or {!Lwt_process}, but not in the ones started by
+      other means, such as [Sys.command], [Unix.system] or
+      [Unix.create_process]. If you use these, disable signalfd with
+      {!set_use_signalfd} before monitoring signals. [SIGCHLD], which
+      [Lwt_unix] always monitors, is never received through the
+      signalfd. *)
+
+val use_signalfd : unit -> bool
+  (** Returns whether signals monitored from now on are received
+      through a signalfd. It is [true] by default on Linux and always
+      [false] on other systems. *)
+
+val set_use_signalfd : bool -> unit
+  (** [set_use_signalfd x] sets whether signals monitored from now on
+      are received through a signalfd. Signals already monitored are
+      not affected. It has no effect on systems without signalfd. *)
+
 val disable_signal_handler : signal_handler_id -> unit
   (** Stops receiving this signal *)
 
@@ -1054,6 +1138,37 @@ val register_action : io_event -> file_descr -> (unit -> 'a) -> 'a Lwt.t
       - you should prefer using {!wrap_syscall}
   *)
 
+val event_hysteresis : unit -> int
+  (** Returns the number of iterations of the main loop during which
+      the watchers of a {b file descriptor} are kept alive after the
+      last action on it terminated. *)
+
+val set_event_hysteresis : int -> unit
+  (** [set_event_hysteresis n] sets the number of iterations of the
+      main loop during which idle watchers are kept alive. Keeping
+      them alive avoids stopping and restarting them between two
+      consecutive actions on the same {b file descriptor}. [0] means
+      that they are stopped at the end of the current iteration. The
+      default is [1]. *)
+
+(** Statistics about the watchers of a {b file descriptor}. *)
+type watcher_stats = {
+  ws_created : int;
+  (** Number of watchers created. *)
+
+  ws_reused : int;
+  (** Number of times an idle watcher was reused by a new action
+      instead of being stopped. *)
+
+  ws_spurious : int;
+  (** Number of times a watcher fired while no action was waiting on
+      it. *)
+}
+
+val watcher_stats : file_descr -> watcher_stats
+  (** [watcher_stats fd] returns statistics about the watchers
+      created for [fd]. *)
+
 type 'a job
   (** Type of job descriptions. A job description describe how to call
       a C function and how to get its result. The C function may be
@@ -78,6 +78,10 @@
 #  include <sys/eventfd.h>
 #endif
 
+#if defined(HAVE_SIGNALFD)
+#  include <sys/signalfd.h>
+#endif
+
 //#define DEBUG_MODE
 
 #if defined(DEBUG_MODE)
@@ -789,6 +793,7 @@ value lwt_unix_init_notification()
 static int signal_notifications[NSIG];
 
 CAMLextern int caml_convert_signal_number (int);
+CAMLextern int caml_rev_convert_signal_number (int);
 
 /* Send a notification when a signal is received. */
 static void handle_signal(int signum)
@@ -889,6 +894,128 @@ CAMLprim value lwt_unix_init_signals()
   return Val_unit;
 }
 
+#if defined(HAVE_SIGNALFD)
+
+/* With signalfd, monitored signals are blocked and read from a file
+   descriptor, so no handler runs in signal context and blocking
+   system calls are not interrupted. Signals are only blocked in the
+   calling thread, so a regular handler is also installed for threads
+   which do not block them. */
+
+static int signalfd_fd = -1;
+
+/* The set of signals received through [signalfd_fd]. */
+static sigset_t signalfd_mask;
+
+/* Blocked signals are inherited through exec, so unblock them in
+   children. */
+static void signalfd_unblock_in_child()
+{
+  pthread_sigmask(SIG_UNBLOCK, &signalfd_mask, NULL);
+}
+
+CAMLprim value lwt_unix_signalfd_init(value unit)
+{
+  if (signalfd_fd == -1) {
+    sigemptyset(&signalfd_mask);
+    signalfd_fd = signalfd(-1, &signalfd_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signalfd_fd == -1) uerror("signalfd", Nothing);
+    pthread_atfork(NULL, NULL, signalfd_unblock_in_child);
+  }
+  return Val_int(signalfd_fd);
+}
+
+static int signalfd_signum(value val_signum)
+{
+  int signum = caml_convert_signal_number(Int_val(val_signum));
+  if (signum <= 0 || signum >= NSIG)
+    caml_invalid_argument("Lwt_unix.on_signal: unavailable signal");
+  return signum;
+}
+
+CAMLprim value lwt_unix_signalfd_add(value val_signum)
+{
+  int signum = signalfd_signum(val_signum);
+  sigset_t set;
+  sigaddset(&signalfd_mask, signum);
+  if (signalfd(signalfd_fd, &signalfd_mask, 0) == -1) {
+    sigdelset(&signalfd_mask, signum);
+    uerror("signalfd", Nothing);
+  }
+  sigemptyset(&set);
+  sigaddset(&set, signum);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  return Val_unit;
+}
+
+CAMLprim value lwt_unix_signalfd_remove(value val_signum)
+{
+  int signum = signalfd_signum(val_signum);
+  sigset_t set;
+  sigdelset(&signalfd_mask, signum);
+  if (signalfd(signalfd_fd, &signalfd_mask, 0) == -1) {
+    sigaddset(&signalfd_mask, signum);
+    uerror("signalfd", Nothing);
+  }
+  sigemptyset(&set);
+  sigaddset(&set, signum);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  return Val_unit;
+}
+
+/* Block monitored signals again, in a child process which continues
+   to use lwt. */
+CAMLprim value lwt_unix_signalfd_restore(value unit)
+{
+  pthread_sigmask(SIG_BLOCK, &signalfd_mask, NULL);
+  return Val_unit;
+}
+
+#define SIGNALFD_BATCH 64
+
+/* Read all available signals, as an array of [signal_info]. */
+CAMLprim value lwt_unix_signalfd_read(value unit)
+{
+  CAMLparam0();
+  CAMLlocal2(result, info);
+  struct signalfd_siginfo buffer[SIGNALFD_BATCH];
+  ssize_t ret = read(signalfd_fd, buffer, sizeof(buffer));
+  int count, i;
+  if (ret == -1) {
+    if (errno == EAGAIN || errno == EINTR) CAMLreturn(Atom(0));
+    uerror("read", Nothing);
+  }
+  count = ret / sizeof(struct signalfd_siginfo);
+  if (count == 0) CAMLreturn(Atom(0));
+  result = caml_alloc_tuple(count);
+  for (i = 0; i < count; i++) {
+    info = caml_alloc_tuple(3);
+    Field(info, 0) = Val_int(caml_rev_convert_signal_number(buffer[i].ssi_signo));
+    Field(info, 1) = Val_int(buffer[i].ssi_pid);
+    Field(info, 2) = Val_int(buffer[i].ssi_uid);
+    Store_field(result, i, info);
+  }
+  CAMLreturn(result);
+}
+
+#endif /* defined(HAVE_SIGNALFD) */
+
+#if !defined(LWT_ON_WINDOWS)
+
+void lwt_unix_child_sigmask(sigset_t *mask)
+{
+#if defined(HAVE_SIGNALFD)
+  int signum;
+#endif
+  pthread_sigmask(SIG_SETMASK, NULL, mask);
+#if defined(HAVE_SIGNALFD)
+  for (signum = 1; signum < NSIG; signum++)
+    if (sigismember(&signalfd_mask, signum)) sigdelset(mask, signum);
+#endif
+}
+
+#endif
+
 /* +-----------------------------------------------------------------+
    | Job execution                                                   |
    +-----------------------------------------------------------------+ */
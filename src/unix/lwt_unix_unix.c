@@ -29,9 +29,12 @@
 #include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
 #include <poll.h>
+#include <math.h>
+#include <limits.h>
 
 /* +-----------------------------------------------------------------+
    | Test for readability/writability                                |
@@ -59,6 +62,172 @@ CAMLprim value lwt_unix_writable(value fd)
   return (Val_bool(pollfd.revents & POLLOUT));
 }
 
+/* +-----------------------------------------------------------------+
+   | Poll sets                                                       |
+   +-----------------------------------------------------------------+ */
+
+/* A poll set is a persistent array of pollfd structures, updated
+   incrementally by the poll engine. Indices of ready entries are
+   stored in [ready] so they can be read back without allocating. */
+struct lwt_unix_poll_set {
+  struct pollfd *fds;
+  int *ready;
+  int count;
+  int capacity;
+  int ready_count;
+};
+
+#define Poll_set_val(v) (*(struct lwt_unix_poll_set**)Data_custom_val(v))
+
+static void finalize_poll_set(value val_set)
+{
+  struct lwt_unix_poll_set *set = Poll_set_val(val_set);
+  free(set->fds);
+  free(set->ready);
+  free(set);
+}
+
+static struct custom_operations poll_set_ops = {
+  "lwt.unix.poll_set",
+  finalize_poll_set,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default
+};
+
+CAMLprim value lwt_unix_poll_create(value unit)
+{
+  struct lwt_unix_poll_set *set = lwt_unix_new(struct lwt_unix_poll_set);
+  set->capacity = 64;
+  set->count = 0;
+  set->ready_count = 0;
+  set->fds = (struct pollfd*)lwt_unix_malloc(set->capacity * sizeof(struct pollfd));
+  set->ready = (int*)lwt_unix_malloc(set->capacity * sizeof(int));
+  value result = caml_alloc_custom(&poll_set_ops, sizeof(struct lwt_unix_poll_set*), 0, 1);
+  Poll_set_val(result) = set;
+  return result;
+}
+
+/* Add a file descriptor, with no events, at the end of the set and
+   return its index. */
+CAMLprim value lwt_unix_poll_add(value val_set, value val_fd)
+{
+  struct lwt_unix_poll_set *set = Poll_set_val(val_set);
+  if (set->count == set->capacity) {
+    /* Only commit the new capacity once both arrays have been
+       grown, so the set stays usable if we run out of memory. */
+    int capacity = set->capacity * 2;
+    struct pollfd *fds = (struct pollfd*)realloc(set->fds, capacity * sizeof(struct pollfd));
+    if (fds == NULL) caml_raise_out_of_memory();
+    set->fds = fds;
+    int *ready = (int*)realloc(set->ready, capacity * sizeof(int));
+    if (ready == NULL) caml_raise_out_of_memory();
+    set->ready = ready;
+    set->capacity = capacity;
+  }
+  struct pollfd *pollfd = &(set->fds[set->count]);
+  pollfd->fd = Int_val(val_fd);
+  pollfd->events = 0;
+  pollfd->revents = 0;
+  return Val_int(set->count++);
+}
+
+CAMLprim value lwt_unix_poll_set_events(value val_set, value val_index, value val_readable, value val_writable)
+{
+  struct pollfd *pollfd = &(Poll_set_val(val_set)->fds[Int_val(val_index)]);
+  pollfd->events = (Bool_val(val_readable) ? POLLIN : 0) | (Bool_val(val_writable) ? POLLOUT : 0);
+  return Val_unit;
+}
+
+/* Remove the entry at the given index by moving the last one in its
+   place. */
+CAMLprim value lwt_unix_poll_remove(value val_set, value val_index)
+{
+  struct lwt_unix_poll_set *set = Poll_set_val(val_set);
+  set->count--;
+  set->fds[Int_val(val_index)] = set->fds[set->count];
+  return Val_unit;
+}
+
+CAMLprim value lwt_unix_poll_wait(value val_set, value val_timeout)
+{
+  struct lwt_unix_poll_set *set = Poll_set_val(val_set);
+  double timeout = Double_val(val_timeout);
+  int timeout_ms, ret, i, count;
+
+  if (timeout < 0)
+    timeout_ms = -1;
+  else if (timeout * 1000.0 >= INT_MAX)
+    /* Long timeouts are clamped, the main loop waits again if
+       needed. */
+    timeout_ms = INT_MAX;
+  else
+    timeout_ms = (int)ceil(timeout * 1000.0);
+
+  caml_enter_blocking_section();
+  ret = poll(set->fds, set->count, timeout_ms);
+  caml_leave_blocking_section();
+
+  set->ready_count = 0;
+  if (ret < 0) uerror("poll", Nothing);
+
+  for (i = 0, count = 0; count < ret && i < set->count; i++)
+    if (set->fds[i].revents) {
+      set->ready[count++] = i;
+    }
+  set->ready_count = count;
+  return Val_int(count);
+}
+
+CAMLprim value lwt_unix_poll_ready_index(value val_set, value val_n)
+{
+  return Val_int(Poll_set_val(val_set)->ready[Int_val(val_n)]);
+}
+
+/* Returns the readiness of the [n]th ready entry: bit 0 is set if it
+   is readable, bit 1 if it is writable. Errors and hang-ups are
+   reported to all requested directions, so actions see the error. */
+CAMLprim value lwt_unix_poll_ready_events(value val_set, value val_n)
+{
+  struct lwt_unix_poll_set *set = Poll_set_val(val_set);
+  struct pollfd *pollfd = &(set->fds[set->ready[Int_val(val_n)]]);
+  int error = pollfd->revents & (POLLERR | POLLHUP | POLLNVAL);
+  int result = 0;
+  if ((pollfd->events & POLLIN) && (error || (pollfd->revents & (POLLIN | POLLPRI))))
+    result |= 1;
+  if ((pollfd->events & POLLOUT) && (error || (pollfd->revents & POLLOUT)))
+    result |= 2;
+  return Val_int(result);
+}
+
+/* +-----------------------------------------------------------------+
+   | Monotonic clock                                                 |
+   +-----------------------------------------------------------------+ */
+
+#if defined(HAVE_MONOTONIC_CLOCK)
+
+CAMLprim value lwt_unix_monotonic_time(value unit)
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    uerror("clock_gettime", Nothing);
+  return caml_copy_double((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+#else
+
+/* Fallback to the wall clock. */
+CAMLprim value lwt_unix_monotonic_time(value unit)
+{
+  struct timeval tv;
+  if (gettimeofday(&tv, NULL) < 0)
+    uerror("gettimeofday", Nothing);
+  return caml_copy_double((double)tv.tv_sec + (double)tv.tv_usec / 1e6);
+}
+
+#endif
+
 /* +-----------------------------------------------------------------+
    | Memory mapped files                                             |
    +-----------------------------------------------------------------+ */
@@ -134,6 +303,20 @@ CAMLprim value lwt_unix_bytes_write(value val_fd, value val_buf, value val_ofs,
   return Val_long(ret);
 }
 
+#if defined(HAVE_SPLICE)
+
+#include <fcntl.h>
+
+CAMLprim value lwt_unix_splice(value val_fd_in, value val_fd_out, value val_len)
+{
+  long ret;
+  ret = splice(Int_val(val_fd_in), NULL, Int_val(val_fd_out), NULL, Long_val(val_len), SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (ret == -1) uerror("splice", Nothing);
+  return Val_long(ret);
+}
+
+#endif
+
 /* +-----------------------------------------------------------------+
    | recv/send                                                       |
    +-----------------------------------------------------------------+ */
@@ -551,6 +734,21 @@ value lwt_unix_has_wait4(value unit)
 
 #endif
 
+#if defined(HAVE_PIDFD)
+
+#include <sys/syscall.h>
+
+/* The returned file descriptor has the close-on-exec flag set by
+   the kernel. */
+CAMLprim value lwt_unix_pidfd_open(value val_pid)
+{
+  int fd = syscall(SYS_pidfd_open, Int_val(val_pid), 0);
+  if (fd < 0) uerror("pidfd_open", Nothing);
+  return Val_int(fd);
+}
+
+#endif
+
 /* +-----------------------------------------------------------------+
    | CPUs                                                            |
    +-----------------------------------------------------------------+ */
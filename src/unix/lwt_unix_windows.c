@@ -170,6 +170,18 @@ CAMLprim value lwt_unix_get_page_size()
   return Val_long(si.dwPageSize);
 }
 
+/* +-----------------------------------------------------------------+
+   | Monotonic clock                                                 |
+   +-----------------------------------------------------------------+ */
+
+CAMLprim value lwt_unix_monotonic_time(value unit)
+{
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return caml_copy_double((double)counter.QuadPart / (double)frequency.QuadPart);
+}
+
 /* +-----------------------------------------------------------------+
    | JOB: read                                                       |
    +-----------------------------------------------------------------+ */
@@ -149,7 +149,7 @@ EXTEND Gram
                              if $lid:id$ > __pa_lwt_max then
                                Lwt.return ()
                              else
-                               Lwt.bind (begin $seq$ end) (fun () -> __pa_lwt_loop ($lid:id$ + 1))
+                               Lwt.bind (begin $seq$ end) (fun () -> Lwt.bind (Lwt.auto_pause ()) (fun () -> __pa_lwt_loop ($lid:id$ + 1)))
                            in
                            __pa_lwt_loop $s$
                    >>
@@ -160,7 +160,7 @@ EXTEND Gram
                              if $lid:id$ < __pa_lwt_min then
                                Lwt.return ()
                              else
-                               Lwt.bind (begin $seq$ end) (fun () -> __pa_lwt_loop ($lid:id$ - 1))
+                               Lwt.bind (begin $seq$ end) (fun () -> Lwt.bind (Lwt.auto_pause ()) (fun () -> __pa_lwt_loop ($lid:id$ - 1)))
                            in
                            __pa_lwt_loop $s$
                    >>
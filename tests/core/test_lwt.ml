@@ -652,4 +652,14 @@ let suite = suite "lwt" [
             let t2 = map (fun () -> "42") waiter in
             wakeup wakener ();
             return (!exns = [Exit] && state t1 = Return 42 && state t2 = Return "42")));
+
+  test "auto_pause"
+    (fun () ->
+       let count = ref 0 in
+       set_slice_budget 3;
+       let t = Lwt_list.iter_s (fun () -> incr count; return ()) [(); (); (); (); ()] in
+       let first = !count in
+       wakeup_paused ();
+       set_slice_budget 0;
+       return (first = 3 && !count = 5 && state t = Return ()));
 ]
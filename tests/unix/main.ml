@@ -23,4 +23,6 @@
 Test.run "unix" [
   Test_lwt_io.suite;
   Test_lwt_io_non_block.suite;
+  Test_lwt_engine.suite;
+  Test_lwt_bytes.suite;
 ]
@@ -0,0 +1,81 @@
+(* Lightweight thread library for Objective Caml
+ * http://www.ocsigen.org/lwt
+ * Module Test_lwt_bytes
+ * Copyright (C) 2012 Jérémie Dimino
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, with linking exceptions;
+ * either version 2.1 of the License, or (at your option) any later
+ * version. See COPYING file for details.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *)
+
+open Lwt
+open Test
+
+(* A buffer big enough to be split into several parts. *)
+let big_buffer () =
+  let len = 3 * 1024 * 1024 + 17 in
+  let buf = Lwt_bytes.create len in
+  for i = 0 to len - 1 do
+    Lwt_bytes.unsafe_set buf i (Char.unsafe_chr ((i * 7 + i / 256) land 255))
+  done;
+  buf
+
+let suite = suite "lwt_bytes" [
+  test "crc32c"
+    (fun () ->
+       lwt crc = Lwt_bytes.crc32c (Lwt_bytes.of_string "123456789") 0 9 in
+       let buf = big_buffer () in
+       let len = Lwt_bytes.length buf in
+       lwt whole = Lwt_bytes.crc32c buf 0 len in
+       lwt first = Lwt_bytes.crc32c buf 0 1000 in
+       lwt chained = Lwt_bytes.crc32c ~crc:first buf 1000 (len - 1000) in
+       return (crc = 0xe3069283l && whole = chained));
+
+  test "xxh64"
+    (fun () ->
+       lwt empty = Lwt_bytes.xxh64 (Lwt_bytes.create 0) 0 0 in
+       lwt abc = Lwt_bytes.xxh64 (Lwt_bytes.of_string "xabcx") 1 3 in
+       return (empty = 0xef46db3751d8e999L && abc = 0x44bc2cf5ad770999L));
+
+  test "find"
+    (fun () ->
+       let buf = big_buffer () in
+       let len = Lwt_bytes.length buf in
+       (* A pattern spanning two parts. *)
+       let ofs = len / 3 - 2 in
+       let pattern = Lwt_bytes.to_string (Lwt_bytes.extract buf ofs 5) ^ "\xff\xff" in
+       Lwt_bytes.blit_string_bytes pattern 0 buf ofs (String.length pattern);
+       lwt found = Lwt_bytes.find buf 0 len pattern in
+       lwt missing = Lwt_bytes.find (Lwt_bytes.of_string "hello world") 0 11 "word" in
+       return (found = Some ofs && missing = None));
+
+  test "frequencies"
+    (fun () ->
+       let buf = big_buffer () in
+       lwt counts = Lwt_bytes.frequencies buf 0 (Lwt_bytes.length buf) in
+       lwt hello = Lwt_bytes.frequencies (Lwt_bytes.of_string "hello") 0 5 in
+       return (Array.fold_left (+) 0 counts = Lwt_bytes.length buf
+               && hello.(Char.code 'l') = 2 && hello.(Char.code 'h') = 1));
+
+  test "parallel blit and fill"
+    (fun () ->
+       let src = big_buffer () in
+       let len = Lwt_bytes.length src in
+       let dst = Lwt_bytes.create len in
+       lwt () = Lwt_bytes.parallel_blit src 0 dst 0 len in
+       let copied = Lwt_bytes.to_string src = Lwt_bytes.to_string dst in
+       lwt () = Lwt_bytes.parallel_fill dst 0 len 'x' in
+       return (copied && Lwt_bytes.to_string dst = String.make len 'x'));
+]
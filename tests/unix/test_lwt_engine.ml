@@ -0,0 +1,213 @@
+(* Lightweight thread library for Objective Caml
+ * http://www.ocsigen.org/lwt
+ * Module Test_lwt_engine
+ * Copyright (C) 2012 Jérémie Dimino
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, with linking exceptions;
+ * either version 2.1 of the License, or (at your option) any later
+ * version. See COPYING file for details.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA
+ * 02111-1307, USA.
+ *)
+
+open Lwt
+open Test
+
+(* Run [f] with the given engine. *)
+let with_engine engine f =
+  let old_engine = Lwt_engine.get () in
+  Lwt_engine.set ~destroy:false engine;
+  try_lwt
+    f ()
+  finally
+    Lwt_engine.set old_engine;
+    return ()
+
+(* Run [f] with the select engine, which uses the timer wheel. *)
+let with_select f = with_engine (new Lwt_engine.select) f
+
+let suite = suite "lwt_engine" [
+  test "timers order"
+    (fun () ->
+       with_select
+         (fun () ->
+            let l = ref [] in
+            let add n delay = ignore (Lwt_engine.on_timer delay false (fun ev -> Lwt_engine.stop_event ev; l := n :: !l)) in
+            add 3 0.03;
+            add 1 0.01;
+            add 2 0.02;
+            lwt () = Lwt_unix.sleep 0.05 in
+            return (List.rev !l = [1; 2; 3])));
+
+  test "stopped timer"
+    (fun () ->
+       with_select
+         (fun () ->
+            let fired = ref false in
+            let ev = Lwt_engine.on_timer 0.01 false (fun ev -> fired := true) in
+            Lwt_engine.stop_event ev;
+            lwt () = Lwt_unix.sleep 0.03 in
+            return (not !fired)));
+
+  test "repeated timer"
+    (fun () ->
+       with_select
+         (fun () ->
+            let count = ref 0 in
+            let ev = Lwt_engine.on_timer 0.01 true (fun ev -> incr count) in
+            lwt () = Lwt_unix.sleep 0.055 in
+            Lwt_engine.stop_event ev;
+            let n = !count in
+            lwt () = Lwt_unix.sleep 0.03 in
+            return (n >= 3 && !count = n)));
+
+  test "many canceled timers"
+    (fun () ->
+       with_select
+         (fun () ->
+            let count = Lwt_engine.timer_count () in
+            let events = Array.init 100000 (fun i -> Lwt_engine.on_timer (float i *. 0.001) false ignore) in
+            Array.iter Lwt_engine.stop_event events;
+            let ok = Lwt_engine.timer_count () = count in
+            lwt () = Lwt_unix.sleep 0.01 in
+            return ok));
+
+  test "far timer"
+    (fun () ->
+       with_select
+         (fun () ->
+            let fired = ref false in
+            let ev = Lwt_engine.on_timer 1e7 false (fun ev -> fired := true) in
+            lwt () = Lwt_unix.sleep 0.01 in
+            Lwt_engine.stop_event ev;
+            return (not !fired)));
+
+  test "timers with slack"
+    (fun () ->
+       with_select
+         (fun () ->
+            let count = ref 0 in
+            let events = Array.init 10 (fun i -> Lwt_engine.on_timer ~slack:0.02 (0.01 +. float i *. 0.001) false (fun ev -> incr count)) in
+            (* Stopping some timers must not affect the other ones of
+               the same bucket. *)
+            Lwt_engine.stop_event events.(0);
+            Lwt_engine.stop_event events.(9);
+            lwt () = Lwt_unix.sleep 0.005 in
+            let early = !count in
+            lwt () = Lwt_unix.sleep 0.05 in
+            Array.iter Lwt_engine.stop_event events;
+            return (early = 0 && !count = 8)));
+
+  test "io watcher"
+    (fun () ->
+       with_select
+         (fun () ->
+            let fd_r, fd_w = Unix.pipe () in
+            let calls = ref [] in
+            let ev = Lwt_engine.on_io fd_w false true (fun ev readable writable -> calls := (readable, writable) :: !calls) in
+            lwt () = Lwt_unix.sleep 0.01 in
+            let fired = !calls <> [] && List.for_all (fun x -> x = (false, true)) !calls in
+            (* Without any direction the watcher must be idle. *)
+            Lwt_engine.modify_io ev false false;
+            let count = Lwt_engine.writable_count () in
+            calls := [];
+            lwt () = Lwt_unix.sleep 0.01 in
+            let idle = !calls = [] in
+            Lwt_engine.stop_event ev;
+            Unix.close fd_r;
+            Unix.close fd_w;
+            return (fired && idle && Lwt_engine.writable_count () = count)));
+
+  test "monitored io watcher"
+    (fun () ->
+       with_select
+         (fun () ->
+            let fd_r, fd_w = Unix.pipe () in
+            let calls = ref 0 in
+            Lwt_main.set_stall_threshold 0.005;
+            let ev = Lwt_engine.on_io fd_w false true
+                       (fun ev readable writable ->
+                          incr calls;
+                          Lwt_engine.stop_event ev;
+                          (* Stall the main loop. *)
+                          let start = Lwt_engine.monotonic_time () in
+                          while Lwt_engine.monotonic_time () -. start < 0.01 do () done) in
+            lwt () = Lwt_unix.sleep 0.01 in
+            Lwt_main.set_stall_threshold 0.;
+            Lwt_engine.stop_event ev;
+            Unix.close fd_r;
+            Unix.close fd_w;
+            let is_io stall =
+              let source = stall.Lwt_main.stall_source in
+              String.length source >= 2 && String.sub source 0 2 = "io" in
+            return (!calls = 1 && List.exists is_io (Lwt_main.recent_stalls ()))));
+
+  test "virtual time"
+    (fun () ->
+       let engine = new Lwt_engine.virtual_time in
+       with_engine engine
+         (fun () ->
+            let real_start = Unix.gettimeofday () and start = Lwt_engine.now () in
+            let l = ref [] in
+            let sleep n delay = lwt () = Lwt_unix.sleep delay in l := n :: !l; return () in
+            lwt () = join [sleep 2 7200.; sleep 1 3600.; sleep 3 86400.] in
+            let elapsed = Lwt_engine.now () -. start in
+            (* Scripted readiness. *)
+            let fd_r, fd_w = Unix.pipe () in
+            let readable = ref false in
+            let ev = Lwt_engine.on_readable fd_r (fun ev -> readable := true) in
+            engine#set_readable fd_r true;
+            lwt () = Lwt_unix.yield () in
+            Lwt_engine.stop_event ev;
+            Unix.close fd_r;
+            Unix.close fd_w;
+            return (List.rev !l = [1; 2; 3]
+                    && elapsed >= 86400. && elapsed < 86401.
+                    && Unix.gettimeofday () -. real_start < 10.
+                    && !readable)));
+
+  test "deadline"
+    (fun () ->
+       with_engine (new Lwt_engine.virtual_time)
+         (fun () ->
+            let start = Lwt_engine.now () in
+            lwt result =
+              try_lwt
+                Lwt_unix.with_deadline 1. (fun () -> lwt () = Lwt_unix.sleep 10. in return true)
+              with Lwt_unix.Timeout ->
+                return false
+            in
+            let elapsed = Lwt_engine.now () -. start in
+            return (not result && elapsed >= 1. && elapsed < 2.)));
+
+  test "poll engine"
+    (fun () ->
+       match try Some (new Lwt_engine.poll) with Lwt_sys.Not_available _ -> None with
+         | None ->
+             return true
+         | Some engine ->
+             with_engine engine
+               (fun () ->
+                  let fd_r1, fd_w1 = Lwt_unix.pipe () and fd_r2, fd_w2 = Lwt_unix.pipe () in
+                  (* Register and unregister a few descriptors so
+                     entries get moved around in the pollfd array. *)
+                  let w1 = Lwt_unix.wait_read fd_r1 in
+                  let w2 = Lwt_unix.wait_read fd_r2 in
+                  cancel w1;
+                  lwt n = Lwt_unix.write fd_w2 "x" 0 1 in
+                  lwt () = w2 in
+                  lwt () = Lwt_unix.wait_write fd_w1 in
+                  lwt () = Lwt_unix.sleep 0.01 in
+                  lwt () = Lwt_list.iter_p Lwt_unix.close [fd_r1; fd_w1; fd_r2; fd_w2] in
+                  return (n = 1)));
+]
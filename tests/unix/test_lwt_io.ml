@@ -59,4 +59,41 @@ let suite = suite "lwt_io" [
               lwt () = Lwt_unix.yield () in
               return (!sent = ["foobar"]))
          oc);
+
+  test "checksum"
+    (fun () ->
+       let ic, oc = pipe ~buffer_size:16 () in
+       let crc_in = checksum ic and crc_out = checksum oc in
+       let xxh_in = checksum ~algorithm:Xxh64 ic and xxh_out = checksum ~algorithm:Xxh64 oc in
+       let data = String.concat "" (Array.to_list (Array.init 100 string_of_int)) in
+       lwt () = write oc "123456789" in
+       lwt () = flush oc in
+       let crc = checksum_value crc_out in
+       lwt () = write oc data in
+       lwt () = close oc in
+       lwt str = read ic in
+       return (str = "123456789" ^ data
+               && crc = 0xe3069283L
+               && checksum_value crc_in = checksum_value crc_out
+               && checksum_value xxh_in = checksum_value xxh_out));
+
+  test "small frames"
+    (fun () ->
+       let ic, oc = pipe ~buffer_size:64 () in
+       let frames = Array.init 200 (fun i -> Printf.sprintf "%07d" i) in
+       let writer =
+         lwt () = Lwt_list.iter_s (write oc) (Array.to_list frames) in
+         close oc
+       in
+       let str = String.create 7 in
+       let rec loop i =
+         if i = Array.length frames then
+           return true
+         else
+           lwt () = read_into_exactly ic str 0 7 in
+           if str = frames.(i) then loop (i + 1) else return false
+       in
+       lwt ok = loop 0 in
+       lwt () = writer in
+       return ok);
 ]